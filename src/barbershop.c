@@ -20,22 +20,30 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #include <arpa/inet.h>
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -44,61 +52,340 @@ THE SOFTWARE.
 #include "stats.h"
 #include <event.h>
 #include "commands.h"
+#include "coalesce.h"
+#include "engine.h"
+#include "journal.h"
+#include "latency.h"
+#include "lockprof.h"
+#include "metrics.h"
+#include "slowlog.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "writer.h"
 
 volatile sig_atomic_t respond_empty = 0;
 
 void on_read(int fd, short ev, void *arg)
 {
 	struct client *client = (struct client *)arg;
-	char buf[64];
-	int len = read(fd, buf, sizeof(buf));
+	int len = evbuffer_read(client->input, fd, READ_CHUNK);
 	if (len == 0) {
-		close(fd);
-		event_del(&client->ev_read);
-		free(client);
+		client_free(client);
 		return;
 	} else if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR) {
+			return;
+		}
 		printf("Socket failure, disconnecting client: %s", strerror(errno));
-		close(fd);
-		event_del(&client->ev_read);
-		free(client);
+		client_free(client);
+		return;
+	}
+	stats_add(bytes_in, len);
+	if (client->blocked || client->engine_barrier) {
+		if (EVBUFFER_LENGTH(client->input) > MAX_QUERY_BUFFER) {
+			client_free(client);
+		}
+		return;
+	}
+	client_process(client);
+}
+
+// Pipelined clients may have sent any number of requests, answer all of
+// the complete ones and leave a trailing partial request buffered. The
+// client is freed if it sent something unparseable. With the engine
+// thread, processing also stops behind a BNEXT until it completes and
+// while the engine is full, and continues from command_complete.
+void client_process(struct client *client)
+{
+	int rc = 0;
+	while (!client->blocked && !client->paused && !client->engine_barrier &&
+			(client->engine_pending == 0 || engine_capacity() > 0) &&
+			(rc = process_request(client)) > 0) {
+		if (EVBUFFER_LENGTH(client->output) > max_output_buffer) {
+			client_pause(client);
+		}
+	}
+	if (rc < 0) {
+		client_flush(client);
+		client_free(client);
+		return;
+	}
+	client_flush(client);
+}
+
+void on_write(int fd, short ev, void *arg)
+{
+	struct client *client = (struct client *)arg;
+	client_flush(client);
+}
+
+// --journal-fsync=always: clients whose output waits for the journal to
+// be made durable. They are written together after a single fsync, once
+// the events ready now have been processed.
+static TAILQ_HEAD(, client) commit_waiters = TAILQ_HEAD_INITIALIZER(commit_waiters);
+static struct event ev_commit;
+// Every client until it is released and the listening socket, for
+// shutdown to close.
+static TAILQ_HEAD(, client) all_clients = TAILQ_HEAD_INITIALIZER(all_clients);
+static struct event ev_accept;
+static int server_fd = -1;
+
+static void on_commit(int fd, short ev, void *arg)
+{
+	struct client *client;
+	journal_commit();
+	while ((client = TAILQ_FIRST(&commit_waiters)) != NULL) {
+		TAILQ_REMOVE(&commit_waiters, client, commits);
+		client->committing = 0;
+		client_write(client);
+	}
+}
+
+void client_flush(struct client *client)
+{
+	if (!journal_uncommitted()) {
+		client_write(client);
+	} else if (!client->committing) {
+		if (TAILQ_EMPTY(&commit_waiters)) {
+			event_active(&ev_commit, EV_TIMEOUT, 1);
+		}
+		client->committing = 1;
+		TAILQ_INSERT_TAIL(&commit_waiters, client, commits);
+	}
+}
+
+// Writes as much of the pending output as the socket takes and waits for
+// it to become writable again if anything is left over.
+void client_write(struct client *client)
+{
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING) {
+		uring_client_flush(client);
+		return;
+	}
+#endif
+	if (EVBUFFER_LENGTH(client->output) == 0) {
+		return;
+	}
+	int written = evbuffer_write(client->output, client->fd);
+	if (written < 0 && errno != EAGAIN && errno != EINTR) {
+		return;
+	}
+	if (written > 0) {
+		stats_add(bytes_out, written);
+	}
+	if (EVBUFFER_LENGTH(client->output) > 0) {
+		event_add(&client->ev_write, NULL);
+	}
+	client_check_resume(client);
+}
+
+void client_pause(struct client *client)
+{
+	client->paused = 1;
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING) {
+		uring_client_pause(client);
+		return;
+	}
+#endif
+	event_del(&client->ev_read);
+}
+
+void client_resume(struct client *client)
+{
+	client->paused = 0;
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING) {
+		uring_client_resume(client);
+	} else
+#endif
+	event_add(&client->ev_read, NULL);
+	client_process(client);
+}
+
+void client_check_resume(struct client *client)
+{
+	size_t pending = EVBUFFER_LENGTH(client->output);
+	if (client->in_flight != NULL) {
+		pending += EVBUFFER_LENGTH(client->in_flight);
+	}
+	if (client->paused && !client->closing && pending <= max_output_buffer / 2) {
+		client_resume(client);
+	}
+}
+
+void client_free(struct client *client)
+{
+	if (client->blocked) {
+		unblock_client(client);
+	}
+	if (client->committing) {
+		TAILQ_REMOVE(&commit_waiters, client, commits);
+		client->committing = 0;
+	}
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING) {
+		uring_client_close(client);
 		return;
 	}
-	if(respond_empty == 1)
-	{
-		reply(fd, "-1\r\n");
+#endif
+	if (client->closing) {
 		return;
 	}
-	process_request(fd, buf);
+	client->closing = 1;
+	event_del(&client->ev_read);
+	event_del(&client->ev_write);
+	client_release(client);
 }
 
+// Releases a closing client once neither the kernel nor the engine thread
+// holds an operation that refers to it.
+void client_release(struct client *client)
+{
+	if (client->uring_pending > 0 || client->engine_pending > 0) {
+		return;
+	}
+	close(client->fd);
+	evbuffer_free(client->input);
+	evbuffer_free(client->output);
+	if (client->in_flight != NULL) {
+		evbuffer_free(client->in_flight);
+	}
+	if (client->held != NULL) {
+		evbuffer_free(client->held);
+	}
+	TAILQ_REMOVE(&all_clients, client, clients);
+	free(client);
+	stats_add(connected_clients, -1);
+}
+
+// Connections arrive in bursts when worker fleets restart, so every
+// pending connection is accepted in one wakeup.
 void on_accept(int fd, short ev, void *arg)
 {
 	int client_fd;
 	struct sockaddr_in client_addr;
-	socklen_t client_len = sizeof(client_addr);
-	struct client *client;
-	client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
-	if (client_fd == -1) {
-		warn("accept failed");
-		return;
+	socklen_t client_len;
+	while (1) {
+		client_len = sizeof(client_addr);
+		client_fd = accept(fd, (struct sockaddr *)&client_addr, &client_len);
+		if (client_fd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				warn("accept failed");
+			}
+			return;
+		}
+		if (setnonblock(client_fd) < 0) {
+			warn("failed to set client socket non-blocking");
+		}
+		if (max_clients > 0 && stats_get(connected_clients) >= max_clients) {
+			client_reject(client_fd);
+			continue;
+		}
+		client_new(client_fd);
 	}
-	if (setnonblock(client_fd) < 0) {
-		warn("failed to set client socket non-blocking");
+}
+
+void client_reject(int fd)
+{
+	static const char *message = "-ERROR MAX CLIENTS REACHED\r\n";
+	if (write(fd, message, strlen(message)) < 0) {
+		// The connection is being refused either way.
 	}
-	client = calloc(1, sizeof(*client));
+	close(fd);
+	stats_add(rejected_clients, 1);
+}
+
+struct client *client_new(int fd)
+{
+	struct client *client = calloc(1, sizeof(*client));
 	if (client == NULL) {
 		err(1, "malloc failed");
 	}
-	event_set(&client->ev_read, client_fd, EV_READ|EV_PERSIST, on_read, client);
+	client->fd = fd;
+	TAILQ_INSERT_TAIL(&all_clients, client, clients);
+	client->input = evbuffer_new();
+	client->output = evbuffer_new();
+	if (client->input == NULL || client->output == NULL) {
+		err(1, "malloc failed");
+	}
+	stats_add(connected_clients, 1);
+	stats_add(connections, 1);
+	if (io_backend == IO_BACKEND_URING) {
+		if ((client->in_flight = evbuffer_new()) == NULL) {
+			err(1, "malloc failed");
+		}
+		return client;
+	}
+	event_set(&client->ev_read, fd, EV_READ|EV_PERSIST, on_read, client);
+	event_set(&client->ev_write, fd, EV_WRITE, on_write, client);
 	event_add(&client->ev_read, NULL);
+	return client;
+}
+
+void on_udp_read(int fd, short ev, void *arg)
+{
+	static char buf[UDP_DATAGRAM_SIZE + 1];
+	char control[CMSG_SPACE(sizeof(uint32_t))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t len;
+	int i;
+	for (i = 0; i < UDP_BATCH; i++) {
+		iov.iov_base = buf;
+		iov.iov_len = UDP_DATAGRAM_SIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		len = recvmsg(fd, &msg, 0);
+		if (len < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				warn("udp receive failed");
+			}
+			return;
+		}
+		stats_add(udp_datagrams, 1);
+		stats_add(bytes_in, len);
+#ifdef SO_RXQ_OVFL
+		// The kernel reports how many datagrams it has dropped on this
+		// socket so far.
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+				memcpy(&app_stats.udp_kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+			}
+		}
+#endif
+		if ((msg.msg_flags & MSG_TRUNC) || respond_empty == 1) {
+			stats_add(udp_drops, 1);
+			continue;
+		}
+		if (len == 0 || buf[len - 1] != '\n') {
+			buf[len++] = '\n';
+		}
+		process_datagram(buf, len);
+	}
 }
 
 int main(int argc, char **argv)
 {
 	int port = SERVER_PORT;
+	int udp_port = 0;
+	int backlog = DEFAULT_BACKLOG;
+	int coalesce_ms = 0;
+	int metrics_port = 0;
 	timeout = 60;
+	max_clients = DEFAULT_MAX_CLIENTS;
+	max_output_buffer = DEFAULT_MAX_OUTPUT_BUFFER;
+	shutdown_timeout = DEFAULT_SHUTDOWN_TIMEOUT;
+	slowlog_threshold = DEFAULT_SLOWLOG_USEC * 1000ULL;
+	journal_fsync = DEFAULT_JOURNAL_FSYNC_MS;
+	load_threads = sysconf(_SC_NPROCESSORS_ONLN);
 	static int daemon_mode = 0;
+	static int engine_thread = 0;
 
 	int c;
 	while (1) {
@@ -107,10 +394,28 @@ int main(int argc, char **argv)
 			{"file",      required_argument, 0, 'f'},
 			{"port",    required_argument, 0, 'p'},
 			{"sync",    required_argument, 0, 's'},
+			{"save",    required_argument, 0, 'r'},
+			{"udp-port", required_argument, 0, 'u'},
+			{"io-backend", required_argument, 0, 'b'},
+			{"backlog", required_argument, 0, 'l'},
+			{"max-clients", required_argument, 0, 'm'},
+			{"max-output-buffer", required_argument, 0, 'o'},
+			{"coalesce-ms", required_argument, 0, 'c'},
+			{"engine-thread", no_argument, &engine_thread, 1},
+			{"lock-profiling", no_argument, &lock_profiling, 1},
+			{"metrics-port", required_argument, 0, 'M'},
+			{"slowlog-usec", required_argument, 0, 'S'},
+			{"snapshot-format", required_argument, 0, 'F'},
+			{"journal", no_argument, &journal_enabled, 1},
+			{"journal-fsync", required_argument, 0, 'J'},
+			{"snapshot-deltas", required_argument, 0, 'D'},
+			{"load-threads", required_argument, 0, 'L'},
+			{"snapshot-rate", required_argument, 0, 'R'},
+			{"shutdown-timeout", required_argument, 0, 'T'},
 			{0, 0, 0, 0}
 		};
 		int option_index = 0;
-		c = getopt_long(argc, argv, "f:p:s:", long_options, &option_index);
+		c = getopt_long(argc, argv, "f:p:s:u:b:l:m:o:c:M:S:F:J:D:L:r:R:T:", long_options, &option_index);
 		if (c == -1) { break; }
 		switch (c) {
 			case 0:
@@ -128,6 +433,81 @@ int main(int argc, char **argv)
 			case 's':
 				timeout = atoi(optarg);
 				break;
+			case 'r':
+				if (add_save_rule(optarg) < 0) {
+					errx(1, "save rules are <seconds>:<changes> or off");
+				}
+				break;
+			case 'u':
+				udp_port = atoi(optarg);
+				break;
+			case 'l':
+				backlog = atoi(optarg);
+				break;
+			case 'm':
+				max_clients = atoi(optarg);
+				break;
+			case 'o':
+				max_output_buffer = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				coalesce_ms = atoi(optarg);
+				break;
+			case 'M':
+				metrics_port = atoi(optarg);
+				break;
+			case 'S':
+				// A negative threshold disables the slow log.
+				slowlog_threshold = atol(optarg) < 0 ? UINT64_MAX : atol(optarg) * 1000ULL;
+				break;
+			case 'F':
+				if (strcmp(optarg, "binary") == 0) {
+					snapshot_format = SNAPSHOT_FORMAT_BINARY;
+				} else if (strcmp(optarg, "text") == 0) {
+					snapshot_format = SNAPSHOT_FORMAT_TEXT;
+				} else if (strcmp(optarg, "packed") == 0) {
+					snapshot_format = SNAPSHOT_FORMAT_PACKED;
+				} else {
+					errx(1, "unknown snapshot format %s", optarg);
+				}
+				break;
+			case 'J':
+				if (strcmp(optarg, "always") == 0) {
+					journal_fsync = JOURNAL_FSYNC_ALWAYS;
+				} else if (strcmp(optarg, "never") == 0) {
+					journal_fsync = JOURNAL_FSYNC_NEVER;
+				} else if (atoi(optarg) > 0) {
+					journal_fsync = atoi(optarg);
+				} else {
+					errx(1, "unknown journal fsync policy %s", optarg);
+				}
+				break;
+			case 'D':
+				snapshot_deltas = atoi(optarg);
+				break;
+			case 'R':
+				// In megabytes a second.
+				snapshot_rate = strtoull(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'L':
+				load_threads = atoi(optarg);
+				break;
+			case 'T':
+				shutdown_timeout = atoi(optarg);
+				break;
+			case 'b':
+				if (strcmp(optarg, "libevent") == 0) {
+					io_backend = IO_BACKEND_LIBEVENT;
+				} else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_IO_URING_BACKEND
+					io_backend = IO_BACKEND_URING;
+#else
+					errx(1, "this build does not support the uring io backend");
+#endif
+				} else {
+					errx(1, "unknown io backend %s", optarg);
+				}
+				break;
 			case '?':
 				/* getopt_long already printed an error message. */
 				break;
@@ -141,6 +521,23 @@ int main(int argc, char **argv)
 	if (sync_file == NULL) {
 		sync_file = "barbershop.snapshot";
 	}
+	// --sync=<seconds> is the rule of saving that often if anything changed.
+	if (save_rule_count == 0) {
+		save_rules[save_rule_count].seconds = timeout;
+		save_rules[save_rule_count++].changes = 1;
+	}
+	save_rule_count = save_rule_count < 0 ? 0 : save_rule_count;
+	// Text snapshots do not record the journal generation they cover.
+	if (journal_enabled && snapshot_format == SNAPSHOT_FORMAT_TEXT) {
+		errx(1, "--journal needs binary snapshots");
+	}
+	if (snapshot_deltas > 0 && snapshot_format == SNAPSHOT_FORMAT_TEXT) {
+		errx(1, "--snapshot-deltas needs binary snapshots");
+	}
+	// Coalesced UPDATEs are answered before they are applied and journaled.
+	if (coalesce_ms > 0 && journal_enabled && journal_fsync == JOURNAL_FSYNC_ALWAYS) {
+		errx(1, "--coalesce-ms can not be used with --journal-fsync=always");
+	}
 
 	// side snapshot file to hot load a snapshot by sending SIGHUP
 	int n = strlen(sync_file);
@@ -148,21 +545,21 @@ int main(int argc, char **argv)
 	sprintf(load_file, "%s.load", sync_file);
 
 	initializePriorityQueue();
+	writer_init();
 
 	time(&app_stats.started_at);
+	app_stats.last_save = app_stats.started_at;
 	app_stats.version = "00.02.01";
-	app_stats.updates = 0;
-	app_stats.items = 0;
-	app_stats.pools = 0;
 	
-	load_snapshot(sync_file);
-	signal(SIGCHLD, SIG_IGN);
+	// The snapshot loads while clients are served, the journal starts
+	// past it and the journals it already has.
+	journal_init(sync_file, snapshot_peek_generation(sync_file));
+	load_begin();
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGTSTP, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGHUP, signal_handler); /* catch hangup signal */
-	signal(SIGTERM, signal_handler); /* catch kill signal */
 	
 	pthread_t garbage_collector;
 	pthread_create(&garbage_collector, NULL, (void *) gc_thread, NULL);
@@ -170,8 +567,12 @@ int main(int argc, char **argv)
 	int listen_fd;
 	struct sockaddr_in listen_addr;
 	int reuseaddr_on = 1;
-	struct event ev_accept;
+	struct event ev_sigterm;
 	event_init();
+	event_set(&ev_commit, -1, 0, on_commit, NULL);
+	// SIGTERM is handled on the network thread, which closes the clients.
+	event_set(&ev_sigterm, SIGTERM, EV_SIGNAL|EV_PERSIST, on_sigterm, NULL);
+	event_add(&ev_sigterm, NULL);
 	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (listen_fd < 0) { err(1, "listen failed"); }
 	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr_on, sizeof(reuseaddr_on)) == -1) { err(1, "setsockopt failed"); }
@@ -180,10 +581,48 @@ int main(int argc, char **argv)
 	listen_addr.sin_addr.s_addr = INADDR_ANY;
 	listen_addr.sin_port = htons(port);
 	if (bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) { err(1, "bind failed"); }
-	if (listen(listen_fd, 5) < 0) { err(1, "listen failed"); }
+	if (listen(listen_fd, backlog) < 0) { err(1, "listen failed"); }
 	if (setnonblock(listen_fd) < 0) { err(1, "failed to set server socket to non-blocking"); }
-	event_set(&ev_accept, listen_fd, EV_READ|EV_PERSIST, on_accept, NULL);
-	event_add(&ev_accept, NULL);
+	server_fd = listen_fd;
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING && uring_init(listen_fd) < 0) {
+		warnx("falling back to the libevent io backend");
+		io_backend = IO_BACKEND_LIBEVENT;
+	}
+#endif
+	if (io_backend == IO_BACKEND_LIBEVENT) {
+		event_set(&ev_accept, listen_fd, EV_READ|EV_PERSIST, on_accept, NULL);
+		event_add(&ev_accept, NULL);
+	}
+
+	if (coalesce_ms > 0) {
+		coalesce_init(coalesce_ms);
+	}
+	if (engine_thread) {
+		engine_init();
+	}
+	if (metrics_port > 0) {
+		metrics_init(metrics_port);
+	}
+
+	struct event ev_udp;
+	if (udp_port > 0) {
+		int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+		int rcvbuf = 4 * 1024 * 1024;
+		int overflow_on = 1;
+		if (udp_fd < 0) { err(1, "udp socket failed"); }
+		setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_RXQ_OVFL
+		setsockopt(udp_fd, SOL_SOCKET, SO_RXQ_OVFL, &overflow_on, sizeof(overflow_on));
+#endif
+		listen_addr.sin_port = htons(udp_port);
+		if (bind(udp_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) { err(1, "udp bind failed"); }
+		if (setnonblock(udp_fd) < 0) { err(1, "failed to set udp socket to non-blocking"); }
+		event_set(&ev_udp, udp_fd, EV_READ|EV_PERSIST, on_udp_read, NULL);
+		event_add(&ev_udp, NULL);
+	}
+	pthread_t loader;
+	pthread_create(&loader, NULL, (void *) startup_thread, NULL);
 	event_dispatch();
 
 	return 0;
@@ -203,74 +642,536 @@ int setnonblock(int fd)
 	return 0;
 }
 
+// The snapshot child being waited for, if any, set and cleared under
+// scores_mutex. Snapshots are taken one at a time, a reload also takes one.
+static volatile pid_t snapshot_pid = 0;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Delta snapshots follow the last snapshot in place, of this generation.
+// The next snapshot must be a full one after a failed snapshot or a reload
+// since the changes tracked for it are lost, and after startup.
+static uint64_t snapshot_generation = 0;
+static int full_snapshot_needed = 1;
+// Set under scores_mutex from the fork until the snapshot thread is done
+// with the snapshot, which took the changes tracked for the next delta.
+static int snapshot_running = 0;
+// Set under scores_mutex once shutdown wrote a snapshot or delta, which a
+// snapshot child that finished before it could be killed must not replace.
+static int shutdown_snapshot_written = 0;
+// app_stats.loading is set under load_mutex while a snapshot loads, one
+// at a time. Snapshots are skipped and shutdown waits meanwhile since the
+// queue being served does not have the snapshot's items yet.
+static pthread_mutex_t load_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t load_done = PTHREAD_COND_INITIALIZER;
+
+// The last snapshot attempted, for retrying a failed one.
+static time_t last_save_attempt = 0;
+
+// Adds a --save rule, "off" leaves none. Returns -1 if it is malformed.
+int add_save_rule(const char *rule)
+{
+	char *end;
+	long seconds;
+	unsigned long long changes;
+	if (strcmp(rule, "off") == 0) {
+		save_rule_count = -1;
+		return 0;
+	}
+	seconds = strtol(rule, &end, 10);
+	if (end == rule || *end != ':' || seconds < 0 || seconds > INT_MAX) {
+		return -1;
+	}
+	rule = end + 1;
+	changes = strtoull(rule, &end, 10);
+	if (end == rule || *end != '\0') {
+		return -1;
+	}
+	if (save_rule_count < 0) {
+		return 0;
+	}
+	if (save_rule_count == MAX_SAVE_RULES) {
+		return -1;
+	}
+	save_rules[save_rule_count].seconds = seconds;
+	save_rules[save_rule_count++].changes = changes;
+	return 0;
+}
+
+// Seconds until the next snapshot is due going by the changes made so
+// far, or -1 if no rule has seen enough of them.
+int64_t next_save(time_t now)
+{
+	uint64_t changes = __atomic_load_n(&app_stats.changes, __ATOMIC_RELAXED) - app_stats.saved_changes;
+	int64_t next = -1, due;
+	int i;
+	for (i = 0; i < save_rule_count; i++) {
+		if (changes < save_rules[i].changes) {
+			continue;
+		}
+		due = app_stats.last_save + save_rules[i].seconds - now;
+		if (app_stats.snapshot_failed && due < last_save_attempt + SAVE_RETRY_SECONDS - now) {
+			due = last_save_attempt + SAVE_RETRY_SECONDS - now;
+		}
+		due = due < 0 ? 0 : due;
+		if (next < 0 || due < next) {
+			next = due;
+		}
+	}
+	return next;
+}
+
+int save_info(char *out, size_t size)
+{
+	int n = 0;
+	n += snprintf(out + n, size - n, "snapshot_changes_since_save:%" PRIu64 "\r\n",
+		__atomic_load_n(&app_stats.changes, __ATOMIC_RELAXED) - app_stats.saved_changes);
+	n += snprintf(out + n, size - n, "snapshot_last_save_time:%ld\r\n", (long)app_stats.last_save);
+	n += snprintf(out + n, size - n, "snapshot_next_save_sec:%" PRId64 "\r\n", next_save(time(NULL)));
+	return n;
+}
+
 void gc_thread()
 {
 	while (1) {
-		sleep(timeout);
-		pthread_mutex_lock(&scores_mutex);
-		sync_to_disk(sync_file);
-		pthread_mutex_unlock(&scores_mutex);
+		sleep(1);
+		if (next_save(time(NULL)) == 0) {
+			fork_snapshot(sync_file);
+		}
 	}
 	pthread_exit(0);
 }
 
+// Writes a snapshot from a forked child, so the queue is only locked while
+// fork() copies the page tables. The child serializes its copy-on-write
+// image while the parent keeps serving, and the file is renamed into
+// place under the lock once the child succeeded, so it can not replace a
+// newer snapshot written on shutdown. Falls back to writing in place if
+// fork fails. The journal moves to the next generation at the fork, and
+// the journals before it are removed once the snapshot is in place.
+//
+// With --snapshot-deltas only the items changed since the last snapshot
+// are written, up to that many times in a row and while the deltas take
+// less than half the size of the full snapshot, then the next full
+// snapshot replaces them.
+void fork_snapshot(char *filename)
+{
+	char tmp_file[32], target[4096];
+	struct dirty_set *dirty;
+	struct stat st;
+	int status, delta, failed;
+	pid_t pid;
+	uint64_t started, locked, forked, generation, since, changes;
+	time_t attempted;
+	pthread_mutex_lock(&snapshot_mutex);
+	if (app_stats.loading) {
+		pthread_mutex_unlock(&snapshot_mutex);
+		return;
+	}
+	started = latency_now();
+	scores_lock(LOCK_SITE_SNAPSHOT);
+	locked = latency_now();
+	delta = snapshot_deltas > 0 && !full_snapshot_needed && app_stats.snapshot_chain < snapshot_deltas &&
+		app_stats.snapshot_chain_bytes <= app_stats.snapshot_base_bytes / 2;
+	// Nothing changed since the last snapshot.
+	if (delta && snapshot_dirty_count() == 0) {
+		scores_unlock(LOCK_SITE_SNAPSHOT);
+		pthread_mutex_unlock(&snapshot_mutex);
+		return;
+	}
+	time(&attempted);
+	last_save_attempt = attempted;
+	changes = app_stats.changes;
+	if (journal_rotate() < 0) {
+		scores_unlock(LOCK_SITE_SNAPSHOT);
+		app_stats.snapshot_failed = 1;
+		pthread_mutex_unlock(&snapshot_mutex);
+		return;
+	}
+	generation = journal_generation();
+	since = snapshot_generation;
+	dirty = snapshot_take_dirty();
+	snapshot_running = 1;
+	pid = fork();
+	if (pid == 0) {
+		scores_unlock(LOCK_SITE_SNAPSHOT);
+		sprintf(tmp_file, "barbershop.%d.tmp", (int)getpid());
+		if (delta) {
+			_exit(write_delta(tmp_file, dirty, since, 1) < 0 ? 1 : 0);
+		}
+		_exit(write_snapshot(tmp_file, 1) < 0 ? 1 : 0);
+	}
+	failed = 0;
+	if (pid < 0) {
+		warn("snapshot fork failed, writing it in place");
+		failed = sync_to_disk(filename) < 0;
+		delta = 0;
+	} else if (pid > 0) {
+		snapshot_pid = pid;
+	}
+	forked = latency_now();
+	scores_unlock(LOCK_SITE_SNAPSHOT);
+	journal_retire();
+	snapshot_free_dirty(dirty);
+	app_stats.snapshot_fork_usec = (forked - locked) / 1000;
+	if (forked - started >= slowlog_threshold) {
+		slowlog_add("SNAPSHOT", filename, strlen(filename), forked - started, -1);
+	}
+	if (delta) {
+		snapshot_delta_filename(target, sizeof(target), filename, generation);
+	} else {
+		snprintf(target, sizeof(target), "%s", filename);
+	}
+	if (pid > 0) {
+		app_stats.snapshot_in_progress = 1;
+		while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+		}
+		sprintf(tmp_file, "barbershop.%d.tmp", (int)pid);
+		scores_lock(LOCK_SITE_SNAPSHOT);
+		snapshot_pid = 0;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0 && !shutdown_snapshot_written) {
+			failed = rename(tmp_file, target) < 0;
+		} else {
+			failed = 1;
+			remove(tmp_file);
+		}
+		scores_unlock(LOCK_SITE_SNAPSHOT);
+		// The rename must be durable before what it replaces is removed.
+		if (!failed && snapshot_sync_dir(target) < 0) {
+			warn("could not sync the snapshot directory");
+			failed = 1;
+		}
+	}
+	if (failed) {
+		full_snapshot_needed = 1;
+	} else {
+		if (!delta) {
+			snapshot_remove_deltas(filename, generation);
+		}
+		journal_compact(generation);
+		app_stats.saved_changes = changes;
+		app_stats.last_save = attempted;
+		snapshot_generation = generation;
+		full_snapshot_needed = 0;
+		st.st_size = 0;
+		stat(target, &st);
+		app_stats.snapshot_bytes = st.st_size;
+		if (delta) {
+			app_stats.snapshot_chain++;
+			app_stats.snapshot_chain_bytes += st.st_size;
+		} else {
+			app_stats.snapshot_chain = 0;
+			app_stats.snapshot_chain_bytes = 0;
+			app_stats.snapshot_base_bytes = st.st_size;
+		}
+	}
+	app_stats.snapshot_failed = failed;
+	app_stats.snapshot_last_delta = delta;
+	app_stats.snapshot_usec = (latency_now() - started) / 1000;
+	app_stats.snapshots++;
+	app_stats.snapshot_in_progress = 0;
+	scores_lock(LOCK_SITE_SNAPSHOT);
+	snapshot_running = 0;
+	scores_unlock(LOCK_SITE_SNAPSHOT);
+	pthread_mutex_unlock(&snapshot_mutex);
+}
+
+// The journals describe changes to the queue before the reload, so it is
+// snapshotted right away. Until that snapshot is in place a restart comes
+// back to the queue as it was before the reload.
 void snap_thread()
 {
-	load_snapshot(load_file);
-	respond_empty = 0;
+	load_begin();
+	load_snapshot(load_file, 0);
+	if (journal_enabled) {
+		fork_snapshot(sync_file);
+	}
 	pthread_exit(0);
 }
 
+// Set once SIGTERM was received, and once the queue is durable.
+static uint64_t shutdown_started = 0;
+static int shutdown_written = 0;
+static struct event ev_shutdown;
+
+// Makes the queue durable the cheapest way there is on shutdown: with
+// --journal by writing out the journal's tail, the snapshot in place, its
+// deltas and the journals since have every change. With --snapshot-deltas
+// by a delta of the items changed since the last snapshot, unless the
+// snapshot being written took them. Otherwise by a full snapshot.
 void write_thread()
 {
-	pthread_mutex_lock(&scores_mutex);
-	sync_to_disk(sync_file);
-	pthread_mutex_unlock(&scores_mutex);
-	respond_empty = 0;
-	exit(0);
+	char tmp_file[32], target[4096];
+	struct dirty_set *dirty;
+	const char *how = NULL;
+	uint64_t started = latency_now();
+	pid_t pid;
+	// Loads are not started past this point.
+	pthread_mutex_lock(&load_mutex);
+	while (app_stats.loading) {
+		pthread_cond_wait(&load_done, &load_mutex);
+	}
+	// Updates handed to the engine thread before SIGTERM were answered.
+	while (__atomic_load_n(&app_stats.engine_in_flight, __ATOMIC_RELAXED) > 0 &&
+			latency_now() - shutdown_started < shutdown_timeout * 1000000000ULL) {
+		usleep(1000);
+	}
+	scores_lock(LOCK_SITE_SNAPSHOT);
+	pid = snapshot_pid;
+	// A snapshot being written by a child is older than this one.
+	if (pid > 0) {
+		kill(pid, SIGKILL);
+		sprintf(tmp_file, "barbershop.%d.tmp", (int)pid);
+		remove(tmp_file);
+	}
+	if (journal_enabled) {
+		journal_commit();
+		how = "journal";
+	} else if (snapshot_deltas > 0 && !full_snapshot_needed && !snapshot_running) {
+		journal_rotate();
+		sprintf(tmp_file, "barbershop.%d.tmp", (int)getpid());
+		snapshot_delta_filename(target, sizeof(target), sync_file, journal_generation());
+		dirty = snapshot_take_dirty();
+		if (write_delta(tmp_file, dirty, snapshot_generation, 0) == 0 && rename(tmp_file, target) == 0 &&
+				snapshot_sync_dir(target) == 0) {
+			how = "delta snapshot";
+		} else {
+			warnx("shutdown: could not write a delta snapshot, writing a full one");
+			remove(tmp_file);
+		}
+		snapshot_free_dirty(dirty);
+	}
+	if (how == NULL) {
+		// Everything in a delta is in this snapshot.
+		journal_rotate();
+		if (sync_to_disk(sync_file) < 0) {
+			errx(8, "shutdown: could not write a full snapshot");
+		}
+		snapshot_remove_deltas(sync_file, journal_generation() + 1);
+		how = "full snapshot";
+	}
+	if (!journal_enabled) {
+		shutdown_snapshot_written = 1;
+	}
+	scores_unlock(LOCK_SITE_SNAPSHOT);
+	warnx("shutdown: %s written in %" PRIu64 " ms", how, (latency_now() - started) / 1000000);
+	__atomic_store_n(&shutdown_written, 1, __ATOMIC_RELEASE);
 }
 
-void load_snapshot(char *filename)
+// Whether a client has no replies left to send and no requests left to
+// answer, pipelined requests get an error each. Closing a socket with
+// requests unread would reset the connection and lose the replies queued
+// in the kernel.
+static int client_drained(struct client *client)
 {
-	respond_empty = 1;
-	pthread_mutex_lock(&scores_mutex);
-	emptyPriorityQueue();
-	FILE *file_in;
-	file_in = fopen(filename, "r");
-	if (file_in == NULL)
-	{
-		pthread_mutex_unlock(&scores_mutex);
+	int unread = 0;
+	if (EVBUFFER_LENGTH(client->output) > 0 || (client->in_flight != NULL && EVBUFFER_LENGTH(client->in_flight) > 0) ||
+			EVBUFFER_LENGTH(client->input) > 0 || client->committing || client->engine_pending > 0) {
+		return 0;
+	}
+	return ioctl(client->fd, FIONREAD, &unread) < 0 || unread == 0;
+}
+
+// Closes the clients with no replies left to send once the queue is
+// durable, and exits once they are all gone or the time is up.
+static void on_shutdown_tick(int fd, short ev, void *arg)
+{
+	struct timeval tick = { 0, SHUTDOWN_TICK_MS * 1000 };
+	struct client *client, *next;
+	uint64_t elapsed = latency_now() - shutdown_started;
+	static int overdue = 0;
+	if (__atomic_load_n(&shutdown_written, __ATOMIC_ACQUIRE)) {
+		for (client = TAILQ_FIRST(&all_clients); client != NULL; client = next) {
+			next = TAILQ_NEXT(client, clients);
+			if (!client->closing && client_drained(client)) {
+				client_free(client);
+			}
+		}
+		if (TAILQ_EMPTY(&all_clients) || elapsed >= shutdown_timeout * 1000000000ULL) {
+			warnx("shutdown: done in %" PRIu64 " ms, %" PRIu64 " clients had replies left", elapsed / 1000000,
+				stats_get(connected_clients));
+			exit(0);
+		}
+	} else if (!overdue && elapsed >= shutdown_timeout * 1000000000ULL) {
+		// Replies were sent for changes that are not durable yet.
+		warnx("shutdown: past --shutdown-timeout, still writing");
+		overdue = 1;
+	}
+	evtimer_add(&ev_shutdown, &tick);
+}
+
+// Stops accepting connections and answers requests with errors from here
+// on, then the queue is made durable while the replies so far are sent.
+void on_sigterm(int fd, short ev, void *arg)
+{
+	struct timeval tick = { 0, SHUTDOWN_TICK_MS * 1000 };
+	pthread_t thread;
+	if (shutdown_started > 0) {
 		return;
 	}
-	char line[80];
-	int item_id, score;
-	while(fgets(line, 80, file_in) != NULL)
-	{
-		sscanf(line, "%d %d", &item_id, &score);
-		int success = update(item_id, score);
+	shutdown_started = latency_now();
+	respond_empty = 1;
+	if (io_backend == IO_BACKEND_LIBEVENT) {
+		event_del(&ev_accept);
+	}
+#ifdef HAVE_IO_URING_BACKEND
+	if (io_backend == IO_BACKEND_URING) {
+		uring_stop_accept();
+	}
+#endif
+	shutdown(server_fd, SHUT_RDWR);
+	warnx("shutdown: stopped accepting connections, %" PRIu64 " clients connected", stats_get(connected_clients));
+	if (coalesce_interval > 0) {
+		coalesce_flush();
+	}
+	pthread_create(&thread, NULL, (void *) write_thread, NULL);
+	pthread_detach(thread);
+	evtimer_set(&ev_shutdown, on_shutdown_tick, NULL);
+	evtimer_add(&ev_shutdown, &tick);
+}
+
+// Waits for a load in progress and marks one as started, then waits for a
+// snapshot being written. Changes to the queue are captured from here on.
+void load_begin()
+{
+	pthread_mutex_lock(&load_mutex);
+	while (app_stats.loading) {
+		pthread_cond_wait(&load_done, &load_mutex);
+	}
+	app_stats.loading = 1;
+	pthread_mutex_unlock(&load_mutex);
+	pthread_mutex_lock(&snapshot_mutex);
+	pthread_mutex_unlock(&snapshot_mutex);
+	scores_lock(LOCK_SITE_RELOAD);
+	journal_capture_begin();
+	scores_unlock(LOCK_SITE_RELOAD);
+}
+
+// Called after load_begin. Builds the queue from a snapshot off to the side
+// while the queue in place keeps serving, then swaps it in under the lock
+// and applies the changes made meanwhile on top of it. At startup the
+// deltas and journals following the snapshot are applied before those.
+// Returns -1 if the file or a delta is damaged or memory runs out, leaving
+// the queue in place if loading the file failed.
+int load_snapshot(char *filename, int startup)
+{
+	struct queue_image image;
+	uint64_t started = latency_now(), swapped, generation = 0;
+	int loaded;
+	memset(&image, 0, sizeof(image));
+	loaded = snapshot_load(filename, &image, &generation);
+	if (loaded == 0 && snapshot_load_text(filename, &image) < 0) {
+		loaded = -1;
+	}
+	scores_lock(LOCK_SITE_RELOAD);
+	swapped = latency_now();
+	if (loaded >= 0) {
+		app_stats.load_items = image.items;
+		swapQueue(&image);
+		full_snapshot_needed = 1;
+	}
+	if (startup && loaded >= 0 && snapshot_load_deltas(filename, &generation) < 0) {
+		loaded = -1;
+	}
+	// The journals replayed and a reloaded queue are not in the snapshot
+	// in place yet.
+	if (startup && loaded >= 0) {
+		app_stats.changes += journal_replay(generation);
+	} else if (loaded >= 0) {
+		app_stats.changes += app_stats.load_items;
 	}
-	fclose(file_in);
-	pthread_mutex_unlock(&scores_mutex);
-	respond_empty = 0;
+	app_stats.load_captured = journal_capture_end(loaded >= 0);
+	app_stats.load_swap_usec = (latency_now() - swapped) / 1000;
+	scores_unlock(LOCK_SITE_RELOAD);
+	// Whichever queue is left in image is no longer served.
+	releaseQueue(&image);
+	scores_lock(LOCK_SITE_RELOAD);
+	reclaimQueue(&image);
+	scores_unlock(LOCK_SITE_RELOAD);
+	uint64_t duration = latency_now() - started;
+	app_stats.load_usec = duration / 1000;
+	app_stats.loads++;
+	pthread_mutex_lock(&load_mutex);
+	app_stats.loading = 0;
+	pthread_cond_broadcast(&load_done);
+	pthread_mutex_unlock(&load_mutex);
+	if (duration >= slowlog_threshold) {
+		slowlog_add("RELOAD", filename, strlen(filename), duration, -1);
+	}
+	return loaded < 0 ? -1 : 0;
 }
 
-void sync_to_disk(char *filename)
+// The next snapshot would replace a damaged one with an empty queue.
+void startup_thread()
+{
+	if (load_snapshot(sync_file, 1) < 0) {
+		errx(1, "refusing to start from a damaged snapshot, move %s and its deltas away to start empty", sync_file);
+	}
+	pthread_exit(0);
+}
+
+// Returns -1 if the file could not be written. Periodic snapshots are
+// throttled to --snapshot-rate.
+int write_snapshot(char *filename, int throttle)
 {
 	FILE *out_file;
+	remove(filename);
+	out_file = writer_open(filename, throttle);
+	if (out_file == NULL) {
+		fprintf(stderr, "Can not open output file\n");
+		return -1;
+	}
+	if (snapshot_format == SNAPSHOT_FORMAT_TEXT) {
+		outputScores(out_file);
+	} else if (snapshot_write(out_file) < 0) {
+		fclose(out_file);
+		return -1;
+	}
+	if (fclose(out_file) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Returns -1 if the file could not be written. Periodic deltas are
+// throttled to --snapshot-rate.
+int write_delta(char *filename, struct dirty_set *set, uint64_t since, int throttle)
+{
+	FILE *out_file;
+	remove(filename);
+	out_file = writer_open(filename, throttle);
+	if (out_file == NULL) {
+		fprintf(stderr, "Can not open output file\n");
+		return -1;
+	}
+	if (snapshot_write_delta(out_file, set, since) < 0) {
+		fclose(out_file);
+		return -1;
+	}
+	if (fclose(out_file) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Writes a snapshot in place. Returns -1 if it could not be written.
+int sync_to_disk(char *filename)
+{
 	time_t now;
 	time(&now);
 	char tmp_file[32];
 	sprintf(tmp_file, "barbershop.%d.tmp", (int)now);
-	remove(tmp_file);
-	out_file = fopen(tmp_file, "w");
-	if (out_file == NULL) {
-		fprintf(stderr, "Can not open output file\n");
-		exit (8);
+	if (write_snapshot(tmp_file, 0) < 0) {
+		remove(tmp_file);
+		return -1;
+	}
+	if (rename(tmp_file, filename) < 0) {
+		remove(tmp_file);
+		return -1;
 	}
-	outputScores(out_file);
-	fclose(out_file);
-	rename(tmp_file, filename);
-	return;
+	if (snapshot_sync_dir(filename) < 0) {
+		warn("could not sync the snapshot directory");
+		return -1;
+	}
+	return 0;
 }
 
 void daemonize()
@@ -306,30 +1207,21 @@ void daemonize()
 	}
 	sprintf(str, "%d\n", getpid());
 	write(lfp, str, strlen(str));
-	signal(SIGCHLD, SIG_IGN);
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGTSTP, SIG_IGN);
 	signal(SIGTTOU, SIG_IGN);
 	signal(SIGTTIN, SIG_IGN);
 	signal(SIGHUP, signal_handler); /* catch hangup signal */
-	signal(SIGTERM, signal_handler); /* catch kill signal */
 }
 
 // TODO: on SIGHUP import data from snapshot.
-// TODO: on SIGTERM exit.
 void signal_handler(int sig)
 {
 	pthread_t sig_thread;
 	switch(sig) {
 		case SIGHUP:
-			respond_empty = 1;
 			pthread_create(&sig_thread, NULL, (void *) snap_thread, NULL);
 			signal(SIGHUP, signal_handler); /* catch hangup signal */
 			break;
-		case SIGTERM:
-			respond_empty = 1;
-			pthread_create(&sig_thread, NULL, (void *) write_thread, NULL);
-			signal(SIGTERM, signal_handler); /* catch hangup signal */
-			break;
 	}
 }
@@ -23,6 +23,9 @@ THE SOFTWARE.
 #ifndef __BARBERSHOP_H__
 #define __BARBERSHOP_H__
 
+#include <signal.h>
+#include <stdint.h>
+#include <sys/queue.h>
 #include <event.h>
 
 #define SERVER_PORT			8002
@@ -30,23 +33,128 @@ THE SOFTWARE.
 #define LOCK_FILE			"barbershop.lock"
 #define LOG_FILE			"barbershop.log"
 
+#define READ_CHUNK			4096
+// Largest UDP payload, and datagrams read per wakeup before yielding to the
+// TCP clients.
+#define UDP_DATAGRAM_SIZE	65507
+#define UDP_BATCH			64
+
+// Connection limits. Reading from a client pauses while more than
+// max_output_buffer bytes of replies are waiting for it and resumes once
+// half of them have been sent. A client sending more than
+// MAX_QUERY_BUFFER bytes that can not be processed yet is disconnected.
+#define DEFAULT_BACKLOG		1024
+#define DEFAULT_MAX_CLIENTS	10000
+#define DEFAULT_MAX_OUTPUT_BUFFER	(1024 * 1024)
+#define MAX_QUERY_BUFFER	(1024 * 1024)
+
+// On SIGTERM the server stops accepting connections, makes the queue
+// durable and closes clients once their replies are sent, for up to
+// --shutdown-timeout seconds. Progress is checked every SHUTDOWN_TICK_MS.
+#define DEFAULT_SHUTDOWN_TIMEOUT	10
+#define SHUTDOWN_TICK_MS	10
+
+// Snapshots are taken once any save rule has seen its number of changes
+// since the last one and its number of seconds have passed, checked every
+// second. A failed snapshot is retried SAVE_RETRY_SECONDS later at the
+// earliest.
+#define MAX_SAVE_RULES		16
+#define SAVE_RETRY_SECONDS	5
+
+struct save_rule {
+	int seconds;
+	uint64_t changes;
+};
+
+#define IO_BACKEND_LIBEVENT	0
+#define IO_BACKEND_URING	1
+
 struct client {
+	int fd;
+	// Wire protocol of the request being processed, see commands.h.
+	int protocol;
 	struct event ev_read;
+	struct event ev_write;
+	struct evbuffer *input;
+	struct evbuffer *output;
+	// Set while the client is parked in BNEXT, requests pipelined behind
+	// it stay buffered until it is woken or times out.
+	int blocked;
+	// Set while reading is paused because too much output is queued.
+	int paused;
+	struct event ev_timeout;
+	TAILQ_ENTRY(client) waiters;
+	// io_uring backend only: output handed to the kernel, whether a send
+	// is outstanding, the number of outstanding operations and whether
+	// the client is waiting for them to finish before being released.
+	struct evbuffer *in_flight;
+	int sending;
+	int uring_pending;
+	int closing;
+	// --engine-thread only: operations submitted to the engine thread and
+	// not completed yet, whether processing waits for a BNEXT to complete,
+	// replies held behind submitted operations, whether a wakeup for a
+	// blocked client is in flight and its BNEXT timed out meanwhile, and
+	// whether it has completions waiting to be processed.
+	int engine_pending;
+	int engine_barrier;
+	struct evbuffer *held;
+	int waking;
+	int timed_out;
+	int completed;
+	TAILQ_ENTRY(client) completions;
+	// --journal-fsync=always only: whether output is held until the
+	// journal is made durable.
+	int committing;
+	TAILQ_ENTRY(client) commits;
+	// Every client until it is released, for shutdown to close them.
+	TAILQ_ENTRY(client) clients;
 };
 
+struct dirty_set;
+
+extern volatile sig_atomic_t respond_empty;
+
 pthread_mutex_t scores_mutex;
 int timeout;
+struct save_rule save_rules[MAX_SAVE_RULES];
+int save_rule_count;
 char *sync_file;
 char *load_file;
+int io_backend;
+int max_clients;
+size_t max_output_buffer;
+int shutdown_timeout;
 
 int main(int argc, char **argv);
 
 void on_read(int fd, short ev, void *arg);
+void on_write(int fd, short ev, void *arg);
 void on_accept(int fd, short ev, void *arg);
+void on_udp_read(int fd, short ev, void *arg);
+void on_sigterm(int fd, short ev, void *arg);
+struct client *client_new(int fd);
+void client_process(struct client *client);
+void client_flush(struct client *client);
+void client_write(struct client *client);
+void client_pause(struct client *client);
+void client_resume(struct client *client);
+void client_check_resume(struct client *client);
+void client_reject(int fd);
+void client_free(struct client *client);
+void client_release(struct client *client);
 int setnonblock(int fd);
 void gc_thread();
-void load_snapshot(char *filename);
-void sync_to_disk(char *filename);
+int add_save_rule(const char *rule);
+int64_t next_save(time_t now);
+int save_info(char *out, size_t size);
+void load_begin();
+int load_snapshot(char *filename, int startup);
+void startup_thread();
+void fork_snapshot(char *filename);
+int write_snapshot(char *filename, int throttle);
+int write_delta(char *filename, struct dirty_set *set, uint64_t since, int throttle);
+int sync_to_disk(char *filename);
 
 void daemonize();
 void signal_handler(int sig);
@@ -47,25 +47,42 @@ THE SOFTWARE.
 #include <fcntl.h>
 #include <signal.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#include "protocol.h"
 
 const int LOW = 1;
 const int HIGH = 500;
 
 void send_command(int sd, char *command);
+void benchmark_parser(int iterations);
+void benchmark_connections(struct sockaddr_in *pin, int connections, int requests, int pipeline);
+void benchmark_startup(struct sockaddr_in *pin);
 
 int main(int argc, char **argv) {
 	char *ipaddress = "127.0.0.1";
 	int port = 8002;
+	int parser_iterations = 0;
+	int connections = 0;
+	int requests = 10000;
+	int pipeline = 16;
+	static int startup = 0;
 
 	int c;
 	while (1) {
 		static struct option long_options[] = {
 			{"ip",      required_argument, 0, 'i'},
 			{"port",    required_argument, 0, 'p'},
+			{"parser",  required_argument, 0, 'P'},
+			{"connections", required_argument, 0, 'c'},
+			{"requests", required_argument, 0, 'r'},
+			{"pipeline", required_argument, 0, 'l'},
+			{"startup", no_argument, &startup, 1},
 			{0, 0, 0, 0}
 		};
 		int option_index = 0;
-		c = getopt_long(argc, argv, "i:p:", long_options, &option_index);
+		c = getopt_long(argc, argv, "i:p:P:c:r:l:", long_options, &option_index);
 		if (c == -1) { break; }
 		switch (c) {
 			case 0:
@@ -80,6 +97,18 @@ int main(int argc, char **argv) {
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 'P':
+				parser_iterations = atoi(optarg);
+				break;
+			case 'c':
+				connections = atoi(optarg);
+				break;
+			case 'r':
+				requests = atoi(optarg);
+				break;
+			case 'l':
+				pipeline = atoi(optarg);
+				break;
 			case '?':
 				/* getopt_long already printed an error message. */
 				break;
@@ -88,6 +117,11 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (parser_iterations > 0) {
+		benchmark_parser(parser_iterations);
+		return 0;
+	}
+
 	struct hostent *hp;
 	struct sockaddr_in pin;
 	int sd;
@@ -102,6 +136,16 @@ int main(int argc, char **argv) {
 	pin.sin_addr.s_addr = ((struct in_addr *)(hp->h_addr))->s_addr;
 	pin.sin_port = htons(port);
 
+	if (connections > 0) {
+		benchmark_connections(&pin, connections, requests, pipeline);
+		return 0;
+	}
+
+	if (startup) {
+		benchmark_startup(&pin);
+		return 0;
+	}
+
 	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
 		perror("socket");
 		exit(1);
@@ -152,3 +196,209 @@ void send_command(int sd, char *command) {
 	buf[numbytes] = '\0';
 	printf("Client-Received: %s", buf);
 }
+
+static double elapsed_ns(struct timespec *start, struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+// Parses a pipelined batch of requests the way the server does: parse,
+// look the command up and convert its numeric arguments. The parser works
+// in place so the batch is copied back before every pass; that copy is
+// timed separately and subtracted.
+static void benchmark_batch(const char *label, const char *batch, int iterations) {
+	size_t length = strlen(batch);
+	char *buf = malloc(length + 1);
+	token_t tokens[MAX_TOKENS];
+	size_t ntokens;
+	int protocol, consumed, value, i;
+	long commands = 0, checksum = 0;
+	struct timespec start, end;
+	double copy_ns, total_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		memcpy(buf, batch, length);
+		checksum += buf[i % length];
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	copy_ns = elapsed_ns(&start, &end);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < iterations; i++) {
+		char *p = buf;
+		size_t left = length;
+		memcpy(buf, batch, length);
+		while ((consumed = parse_request(p, left, &protocol, tokens, &ntokens)) > 0) {
+			checksum += lookup_command(tokens[COMMAND_TOKEN].value, tokens[COMMAND_TOKEN].length);
+			if (ntokens > 2 && parse_integer(&tokens[KEY_TOKEN], &value) == 0) {
+				checksum += value;
+			}
+			commands++;
+			p += consumed;
+			left -= consumed;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	total_ns = elapsed_ns(&start, &end) - copy_ns;
+
+	printf("%-10s %10ld commands %8.1f ns/command (checksum %ld)\n", label, commands, total_ns / commands, checksum);
+	free(buf);
+}
+
+void benchmark_parser(int iterations) {
+	benchmark_batch("inline",
+		"UPDATE 61231 5\r\nUPDATE 12353 1\r\nNEXT\r\nPEEK\r\nSCORE 61231\r\nBNEXT 30\r\nINFO\r\n",
+		iterations);
+	benchmark_batch("multibulk",
+		"*3\r\n$6\r\nUPDATE\r\n$5\r\n61231\r\n$1\r\n5\r\n"
+		"*3\r\n$6\r\nUPDATE\r\n$5\r\n12353\r\n$1\r\n1\r\n"
+		"*1\r\n$4\r\nNEXT\r\n*1\r\n$4\r\nPEEK\r\n"
+		"*2\r\n$5\r\nSCORE\r\n$5\r\n61231\r\n"
+		"*2\r\n$5\r\nBNEXT\r\n$2\r\n30\r\n"
+		"*1\r\n$4\r\nINFO\r\n",
+		iterations);
+}
+
+struct bench_connection {
+	int fd;
+	int sent;
+	int received;
+};
+
+// Keeps the given number of connections busy sending windows of pipelined
+// UPDATEs, each connection sending its next window once every reply to the
+// previous one has arrived. Run against each io backend to compare them.
+void benchmark_connections(struct sockaddr_in *pin, int connections, int requests, int pipeline) {
+	struct bench_connection *conns = calloc(connections, sizeof(struct bench_connection));
+	struct pollfd *fds = calloc(connections, sizeof(struct pollfd));
+	char *batch = malloc(pipeline * 32);
+	char buf[4096];
+	struct timespec start, end;
+	int i, j, done = 0;
+
+	for (i = 0; i < connections; i++) {
+		if ((conns[i].fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(conns[i].fd, (struct sockaddr *)pin, sizeof(*pin)) == -1) {
+			perror("connect");
+			exit(1);
+		}
+		fds[i].fd = conns[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (done < connections) {
+		for (i = 0; i < connections; i++) {
+			struct bench_connection *conn = &conns[i];
+			if (conn->received < conn->sent || conn->sent == requests) {
+				continue;
+			}
+			int n = 0, len = 0;
+			while (n < pipeline && conn->sent + n < requests) {
+				len += sprintf(batch + len, "UPDATE %d 1\r\n", rand() % (HIGH - LOW + 1) + LOW);
+				n++;
+			}
+			if (send(conn->fd, batch, len, 0) != len) {
+				perror("send");
+				exit(1);
+			}
+			conn->sent += n;
+		}
+		if (poll(fds, connections, -1) < 0) {
+			perror("poll");
+			exit(1);
+		}
+		for (i = 0; i < connections; i++) {
+			if (!(fds[i].revents & POLLIN)) {
+				continue;
+			}
+			int n = recv(fds[i].fd, buf, sizeof(buf), 0);
+			if (n <= 0) {
+				perror("recv()");
+				exit(1);
+			}
+			for (j = 0; j < n; j++) {
+				if (buf[j] == '\n') {
+					conns[i].received++;
+				}
+			}
+			if (conns[i].received == requests) {
+				fds[i].fd = -1;
+				done++;
+			}
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double seconds = elapsed_ns(&start, &end) / 1e9;
+	long total = (long)connections * requests;
+	printf("%d connections, %ld requests in %.3f s: %.0f requests/s\n", connections, total, seconds, total / seconds);
+	for (i = 0; i < connections; i++) {
+		close(conns[i].fd);
+	}
+	free(conns);
+	free(fds);
+	free(batch);
+}
+
+// Sends INFO followed by PING, whose reply marks the end of it, and picks
+// the fields out of the reply.
+static void startup_info(int fd, int *loading, unsigned long long *items, unsigned long long *usec) {
+	char buf[8192];
+	int len = 0, n;
+	if (send(fd, "INFO\r\nPING\r\n", 12, 0) != 12) {
+		perror("send");
+		exit(1);
+	}
+	buf[0] = '\0';
+	while (strstr(buf, "PONG") == NULL) {
+		if (len == sizeof(buf) - 1 || (n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) <= 0) {
+			perror("recv()");
+			exit(1);
+		}
+		len += n;
+		buf[len] = '\0';
+	}
+	char *field;
+	if ((field = strstr(buf, "loading:")) != NULL) { *loading = atoi(field + 8); }
+	if ((field = strstr(buf, "load_last_items:")) != NULL) { *items = strtoull(field + 16, NULL, 10); }
+	if ((field = strstr(buf, "load_last_usec:")) != NULL) { *usec = strtoull(field + 15, NULL, 10); }
+}
+
+// Waits for a server that was just started to load its snapshot, it
+// accepts clients meanwhile, and reports how fast the snapshot loaded.
+void benchmark_startup(struct sockaddr_in *pin) {
+	unsigned long long items = 0, usec = 0;
+	int fd, loading = 1, attempts;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (attempts = 0; ; attempts++) {
+		if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(fd, (struct sockaddr *)pin, sizeof(*pin)) == 0) {
+			break;
+		}
+		close(fd);
+		if (attempts == 10000) {
+			perror("connect");
+			exit(1);
+		}
+		usleep(1000);
+	}
+	while (1) {
+		startup_info(fd, &loading, &items, &usec);
+		if (!loading) {
+			break;
+		}
+		usleep(1000);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+	printf("%llu items loaded in %.3f s: %.0f items/s (%.3f s until loaded as seen by the client)\n", items, usec / 1e6,
+		usec > 0 ? items / (usec / 1e6) : 0.0, elapsed_ns(&start, &end) / 1e9);
+}
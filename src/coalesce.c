@@ -0,0 +1,138 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/*
+ * Write-combining of UPDATE increments, enabled with --coalesce-ms.
+ *
+ * Hot items receive many small increments. Instead of moving the item
+ * between pools once per UPDATE, increments are summed per item and
+ * applied as one update per item every coalesce_interval milliseconds,
+ * which is also how stale NEXT, PEEK and SCORE may be. Items are applied
+ * in the order they were first seen so ties keep their arrival order.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "barbershop.h"
+#include "coalesce.h"
+#include "commands.h"
+#include "engine.h"
+#include "journal.h"
+#include "lockprof.h"
+#include "pqueue.h"
+#include "stats.h"
+
+static struct coalesce_entry *table;
+// Slots in use, in the order their item was first seen.
+static unsigned int *order;
+static unsigned int used = 0;
+static struct event ev_flush;
+static struct timeval flush_interval;
+
+static void on_coalesce_timer(int fd, short ev, void *arg)
+{
+	coalesce_flush();
+	evtimer_add(&ev_flush, &flush_interval);
+}
+
+void coalesce_init(int interval_ms)
+{
+	coalesce_interval = interval_ms;
+	table = calloc(COALESCE_SLOTS, sizeof(struct coalesce_entry));
+	order = malloc(COALESCE_SLOTS * sizeof(unsigned int));
+	if (table == NULL || order == NULL) {
+		err(1, "malloc failed");
+	}
+	flush_interval.tv_sec = interval_ms / 1000;
+	flush_interval.tv_usec = (interval_ms % 1000) * 1000;
+	evtimer_set(&ev_flush, on_coalesce_timer, NULL);
+	evtimer_add(&ev_flush, &flush_interval);
+}
+
+// Item id 0 is never valid so it marks an empty slot.
+void coalesce_add(int item_id, int score)
+{
+	unsigned int i = ((uint32_t)item_id * 2654435761u) >> (32 - COALESCE_BITS);
+	while (table[i].item_id != 0 && table[i].item_id != item_id) {
+		i = (i + 1) & (COALESCE_SLOTS - 1);
+	}
+	if (table[i].item_id == 0) {
+		table[i].item_id = item_id;
+		table[i].score = 0;
+		order[used++] = i;
+	}
+	table[i].score += score;
+	stats_add(coalesce_received, 1);
+	if (used >= COALESCE_SLOTS / 4 * 3) {
+		coalesce_flush();
+	}
+}
+
+void coalesce_flush()
+{
+	struct engine_op op = { .type = ENGINE_UPDATE };
+	unsigned int i = 0, j;
+	if (used == 0) {
+		return;
+	}
+	// With the engine thread the merged updates are queued for it, any that
+	// do not fit are applied here.
+	while (engine_enabled && i < used) {
+		op.npairs = 0;
+		for (j = i; j < used && op.npairs < ENGINE_MAX_PAIRS; j++) {
+			op.item_ids[op.npairs] = table[order[j]].item_id;
+			op.scores[op.npairs] = table[order[j]].score;
+			op.npairs++;
+		}
+		if (engine_submit(&op, 0) < 0) {
+			break;
+		}
+		for (; i < j; i++) {
+			table[order[i]].item_id = 0;
+		}
+	}
+	stats_add(coalesce_applied, used);
+	if (i == used) {
+		used = 0;
+		return;
+	}
+	scores_lock(LOCK_SITE_COALESCE);
+	for (; i < used; i++) {
+		struct coalesce_entry *entry = &table[order[i]];
+		journal_update(entry->item_id, entry->score);
+		entry->item_id = 0;
+	}
+	scores_unlock(LOCK_SITE_COALESCE);
+	used = 0;
+	serve_waiters();
+}
+
+unsigned int coalesce_pending()
+{
+	return used;
+}
@@ -28,6 +28,7 @@ THE SOFTWARE.
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
@@ -42,133 +43,763 @@ THE SOFTWARE.
 #include <unistd.h>
 
 #include "commands.h"
+#include "coalesce.h"
+#include "engine.h"
+#include "journal.h"
+#include "latency.h"
+#include "lockprof.h"
 #include "pqueue.h"
+#include "slowlog.h"
+#include "snapshot.h"
 #include "stats.h"
+#include "writer.h"
 #include "barbershop.h"
 
-void command_update(int fd, token_t *tokens) {
-	int item_id = atoi(tokens[KEY_TOKEN].value);
-	int score = atoi(tokens[VALUE_TOKEN].value);
-	if (item_id == 0) {
-		reply(fd, "-ERROR INVALID ITEM ID\r\n");
-		return;
+// Indexed by command_type. ntokens counts the command name, its arguments
+// and the parser's terminator token, 0 if the handler checks its own
+// arguments.
+static struct command command_table[COMMAND_COUNT] = {
+	[COMMAND_UPDATE] = { "UPDATE", 4, command_update },
+	[COMMAND_MUPDATE] = { "MUPDATE", 0, command_mupdate },
+	[COMMAND_NEXT] = { "NEXT", 2, command_next },
+	[COMMAND_BNEXT] = { "BNEXT", 3, command_bnext },
+	[COMMAND_PEEK] = { "PEEK", 2, command_peek },
+	[COMMAND_SCORE] = { "SCORE", 3, command_score },
+	[COMMAND_INFO] = { "INFO", 2, command_info },
+	[COMMAND_PING] = { "PING", 2, command_ping },
+	[COMMAND_STATS] = { "STATS", 0, command_stats },
+	[COMMAND_SLOWLOG] = { "SLOWLOG", 0, command_slowlog },
+};
+
+// Time from parsing a request until it is answered (or its client parked
+// in BNEXT) and time spent waiting for scores_mutex, per command.
+static struct latency_histogram command_latency[COMMAND_COUNT];
+static struct latency_histogram lock_latency[COMMAND_COUNT];
+// The request being dispatched, and whether it was handed to the engine.
+static int current_command;
+static uint64_t request_started;
+static int request_deferred;
+
+// Clients parked in BNEXT, served in the order they blocked.
+static TAILQ_HEAD(, client) next_waiters = TAILQ_HEAD_INITIALIZER(next_waiters);
+static unsigned int blocked_clients = 0;
+
+// Clients with engine completions since the last process_completed(), so
+// a client's replies are flushed with one write per batch.
+static TAILQ_HEAD(, client) completed_clients = TAILQ_HEAD_INITIALIZER(completed_clients);
+
+static const char *parse_updates(token_t *tokens, size_t npairs, int *item_ids, int *scores);
+static const char *apply_pairs(int *item_ids, int *scores, size_t npairs);
+static void block_client(struct client *client, int timeout);
+
+// Arguments come from the request's tokens, or from the engine operation
+// when the command was deferred and its tokens are gone.
+static void log_slow_command(struct client *client, int command, uint64_t duration, token_t *tokens, size_t ntokens, struct engine_op *op) {
+	char args[SLOWLOG_ARGS];
+	size_t i, n = 0;
+	if (tokens != NULL) {
+		for (i = KEY_TOKEN; i < ntokens && tokens[i].value != NULL && n < sizeof(args); i++) {
+			n += snprintf(args + n, sizeof(args) - n, "%s%.*s", n > 0 ? " " : "", (int)tokens[i].length, tokens[i].value);
+		}
+	} else {
+		for (i = 0; i < op->npairs && n < sizeof(args); i++) {
+			n += snprintf(args + n, sizeof(args) - n, "%s%d %d", n > 0 ? " " : "", op->item_ids[i], op->scores[i]);
+		}
 	}
-	if (score < 1) {
-		reply(fd, "-ERROR INVALID SCORE\r\n");
-		return;
+	if (n >= sizeof(args)) {
+		n = sizeof(args) - 1;
+	}
+	slowlog_add(command_table[command].name, args, n, duration, client->closing ? -1 : client->fd);
+}
+
+// Records how long a command took, fast commands pay one comparison for
+// the slow log.
+static void command_done(struct client *client, int command, uint64_t duration, token_t *tokens, size_t ntokens, struct engine_op *op) {
+	latency_record(&command_latency[command], duration);
+	if (duration >= slowlog_threshold) {
+		log_slow_command(client, command, duration, tokens, ntokens, op);
 	}
+}
+
+// Takes scores_mutex for the command being run, recording how long it had
+// to wait.
+static void lock_scores(int command, int site) {
+	latency_record(&lock_latency[command], scores_lock(site));
+}
 
-	pthread_mutex_lock(&scores_mutex);
-	int success = update(item_id, score);
-	pthread_mutex_unlock(&scores_mutex);
+// Hands an operation to the engine thread, the client's reply is sent from
+// command_complete. Returns 0 when there is no engine thread or it is full,
+// in which case the caller runs the command itself.
+static int engine_defer(struct client *client, struct engine_op *op) {
+	if (!engine_enabled) {
+		return 0;
+	}
+	op->client = client;
+	if (client != NULL) {
+		op->command = current_command;
+		op->started = request_started;
+	}
+	if (engine_submit(op, 0) < 0) {
+		return 0;
+	}
+	if (client != NULL) {
+		client->engine_pending++;
+		request_deferred = 1;
+	}
+	return 1;
+}
 
-	if(success >= 0)
-		reply(fd, "+OK\r\n");
+static void update_and_reply(struct client *client, token_t *tokens, size_t npairs) {
+	struct engine_op op = { .type = ENGINE_UPDATE, .npairs = npairs };
+	const char *error = parse_updates(tokens, npairs, op.item_ids, op.scores);
+	if (error == NULL) {
+		if (coalesce_interval == 0 && engine_defer(client, &op)) {
+			return;
+		}
+		error = apply_pairs(op.item_ids, op.scores, npairs);
+	}
+	if (error == NULL)
+		reply_status(client, "OK");
 	else
-		reply(fd, "-ERROR UPDATE FAILED\r\n");
+		reply_error(client, error);
+}
+
+void command_update(struct client *client, token_t *tokens) {
+	update_and_reply(client, &tokens[KEY_TOKEN], 1);
+}
+
+void command_mupdate(struct client *client, token_t *tokens) {
+	size_t n = KEY_TOKEN;
+	while (tokens[n].value != NULL && tokens[n].length > 0) {
+		n++;
+	}
+	// A non-NULL terminator means an empty argument or an inline request
+	// with more arguments than the tokenizer keeps.
+	if (tokens[n].value != NULL || n == KEY_TOKEN || (n - KEY_TOKEN) % 2 != 0) {
+		reply_error(client, "ERROR");
+		return;
+	}
+	update_and_reply(client, &tokens[KEY_TOKEN], (n - KEY_TOKEN) / 2);
+}
+
+// Nothing is applied unless every "<item id> <score>" pair is valid.
+static const char *parse_updates(token_t *tokens, size_t npairs, int *item_ids, int *scores) {
+	size_t i;
+	for (i = 0; i < npairs; i++) {
+		if (parse_integer(&tokens[2 * i], &item_ids[i]) < 0 || item_ids[i] == 0) {
+			return "ERROR INVALID ITEM ID";
+		}
+		if (parse_integer(&tokens[2 * i + 1], &scores[i]) < 0 || scores[i] < 1) {
+			return "ERROR INVALID SCORE";
+		}
+	}
+	return NULL;
+}
+
+// Applies validated pairs under a single lock, or hands them to the
+// coalescing stage when it is enabled.
+static const char *apply_pairs(int *item_ids, int *scores, size_t npairs) {
+	int success = 0;
+	size_t i;
+	if (coalesce_interval > 0) {
+		for (i = 0; i < npairs; i++) {
+			coalesce_add(item_ids[i], scores[i]);
+		}
+		return NULL;
+	}
+
+	lock_scores(current_command, LOCK_SITE_UPDATE);
+	for (i = 0; i < npairs && success >= 0; i++) {
+		success = journal_update(item_ids[i], scores[i]);
+	}
+	scores_unlock(LOCK_SITE_UPDATE);
+
+	serve_waiters();
+	return success >= 0 ? NULL : "ERROR UPDATE FAILED";
+}
+
+// Applies "<item id> <score>" pairs that have no client waiting for a
+// reply, queueing them for the engine thread when it is enabled. Returns
+// NULL on success or the error message.
+const char *apply_updates(token_t *tokens, size_t npairs) {
+	struct engine_op op = { .type = ENGINE_UPDATE, .npairs = npairs };
+	const char *error = parse_updates(tokens, npairs, op.item_ids, op.scores);
+	if (error != NULL) {
+		return error;
+	}
+	if (coalesce_interval == 0 && engine_defer(NULL, &op)) {
+		return NULL;
+	}
+	return apply_pairs(op.item_ids, op.scores, npairs);
+}
+
+void command_next(struct client *client, token_t *tokens) {
+	struct engine_op op = { .type = ENGINE_NEXT };
+	if (engine_defer(client, &op)) {
+		return;
+	}
+	int next;
+	lock_scores(current_command, LOCK_SITE_NEXT);
+	next = journal_next();
+	scores_unlock(LOCK_SITE_NEXT);
+	reply_integer(client, next);
 }
 
-void command_next(int fd, token_t *tokens) {
+void command_bnext(struct client *client, token_t *tokens) {
+	int timeout;
+	if (parse_integer(&tokens[KEY_TOKEN], &timeout) < 0 || timeout < 0) {
+		reply_error(client, "ERROR INVALID TIMEOUT");
+		return;
+	}
+	// Requests behind a BNEXT wait until it is known whether it blocks.
+	struct engine_op op = { .type = ENGINE_NEXT, .flags = ENGINE_FLAG_BNEXT, .timeout = timeout };
+	if (engine_defer(client, &op)) {
+		client->engine_barrier = 1;
+		return;
+	}
 	int next;
-	pthread_mutex_lock(&scores_mutex);
-	next = getNext();
-	pthread_mutex_unlock(&scores_mutex);
+	lock_scores(current_command, LOCK_SITE_NEXT);
+	next = journal_next();
+	scores_unlock(LOCK_SITE_NEXT);
+	if (next != -1) {
+		reply_integer(client, next);
+		return;
+	}
+	block_client(client, timeout);
+}
+
+static void block_client(struct client *client, int timeout) {
+	client->blocked = 1;
+	client->waking = 0;
+	client->timed_out = 0;
+	TAILQ_INSERT_TAIL(&next_waiters, client, waiters);
+	blocked_clients++;
+	if (timeout > 0) {
+		struct timeval tv = { timeout, 0 };
+		evtimer_set(&client->ev_timeout, on_bnext_timeout, client);
+		evtimer_add(&client->ev_timeout, &tv);
+	}
+}
+
+void on_bnext_timeout(int fd, short ev, void *arg) {
+	struct client *client = (struct client *)arg;
+	// The item being fetched for the client decides how it is answered.
+	if (client->waking) {
+		client->timed_out = 1;
+		return;
+	}
+	unblock_client(client);
+	reply_integer(client, -1);
+	client_process(client);
+}
 
-	char msg[32];
-	sprintf(msg, "+%d\r\n", next);
-	reply(fd, msg);
+void unblock_client(struct client *client) {
+	TAILQ_REMOVE(&next_waiters, client, waiters);
+	blocked_clients--;
+	client->blocked = 0;
+	if (evtimer_initialized(&client->ev_timeout)) {
+		evtimer_del(&client->ev_timeout);
+	}
 }
 
-void command_peek(int fd, token_t *tokens) {
+// Hands queued items to blocked clients, one item per waiter, oldest
+// waiter first. With the engine thread a single item is fetched for the
+// oldest waiter not already being woken, callers call this once per
+// update applied.
+void serve_waiters() {
+	struct client *client;
 	int next;
-	pthread_mutex_lock(&scores_mutex);
-	next = peekNext();
-	pthread_mutex_unlock(&scores_mutex);
-	char msg[32];
-	sprintf(msg, "+%d\r\n", next);
-	reply(fd, msg);
+	if (engine_enabled) {
+		TAILQ_FOREACH(client, &next_waiters, waiters) {
+			if (!client->waking) {
+				struct engine_op op = { .type = ENGINE_NEXT, .flags = ENGINE_FLAG_WAKE, .client = client };
+				if (engine_submit(&op, 0) == 0) {
+					client->waking = 1;
+					client->engine_pending++;
+				}
+				return;
+			}
+		}
+		return;
+	}
+	while ((client = TAILQ_FIRST(&next_waiters)) != NULL) {
+		lock_scores(COMMAND_BNEXT, LOCK_SITE_NEXT);
+		next = journal_next();
+		scores_unlock(LOCK_SITE_NEXT);
+		if (next == -1) {
+			return;
+		}
+		unblock_client(client);
+		reply_integer(client, next);
+		client_process(client);
+	}
+}
+
+// Called on the network thread for every operation the engine thread has
+// run.
+void command_complete(struct engine_op *op) {
+	struct client *client = op->client;
+	int i;
+	if (op->type == ENGINE_UPDATE) {
+		for (i = 0; i < op->npairs; i++) {
+			serve_waiters();
+		}
+	}
+	if (client == NULL) {
+		return;
+	}
+	client->engine_pending--;
+	if (op->started != 0) {
+		command_done(client, op->command, latency_now() - op->started, NULL, 0, op);
+	}
+	if (client->closing) {
+		if (op->reply != NULL) {
+			evbuffer_free(op->reply);
+		}
+		client_release(client);
+		return;
+	}
+	switch (op->type) {
+		case ENGINE_NOP:
+			evbuffer_add_buffer(client->output, op->reply);
+			evbuffer_free(op->reply);
+			break;
+		case ENGINE_UPDATE:
+			if (op->result >= 0)
+				reply_status(client, "OK");
+			else
+				reply_error(client, "ERROR UPDATE FAILED");
+			break;
+		case ENGINE_NEXT:
+			if (op->flags & ENGINE_FLAG_WAKE) {
+				client->waking = 0;
+				if (op->result == -1 && !client->timed_out) {
+					return;
+				}
+				unblock_client(client);
+			} else if (op->flags & ENGINE_FLAG_BNEXT) {
+				client->engine_barrier = 0;
+				if (op->result == -1) {
+					block_client(client, op->timeout);
+					// Items updated while the BNEXT was in flight did not
+					// see this client waiting.
+					serve_waiters();
+					return;
+				}
+			}
+			reply_integer(client, op->result);
+			break;
+		case ENGINE_INFO:
+			command_info(client, NULL);
+			break;
+		default:
+			reply_integer(client, op->result);
+			break;
+	}
+	if (!client->completed) {
+		client->completed = 1;
+		TAILQ_INSERT_TAIL(&completed_clients, client, completions);
+	}
+}
+
+void process_completed() {
+	struct client *client;
+	while ((client = TAILQ_FIRST(&completed_clients)) != NULL) {
+		TAILQ_REMOVE(&completed_clients, client, completions);
+		client->completed = 0;
+		client_process(client);
+	}
+}
+
+// PEEK and SCORE read the queue without locking. With the engine thread
+// they only wait for it when earlier requests on the connection are still
+// in flight, so they see the client's own updates.
+void command_peek(struct client *client, token_t *tokens) {
+	struct engine_op op = { .type = ENGINE_PEEK };
+	if (client->engine_pending > 0 && engine_defer(client, &op)) {
+		return;
+	}
+	reply_integer(client, peekNext());
 }
 
-void command_score(int fd, token_t *tokens) {
-	int item_id = atoi(tokens[KEY_TOKEN].value);
-	if (item_id == 0) {
-		reply(fd, "-ERROR INVALID ITEM ID\r\n");
+void command_score(struct client *client, token_t *tokens) {
+	int item_id;
+	if (parse_integer(&tokens[KEY_TOKEN], &item_id) < 0 || item_id == 0) {
+		reply_error(client, "ERROR INVALID ITEM ID");
 		return;
 	}
-	int score = getScore(item_id);
-	char msg[32];
-	sprintf(msg, "+%d\r\n", score);
-	reply(fd, msg);
+	struct engine_op op = { .type = ENGINE_SCORE, .item_ids = { item_id } };
+	if (client->engine_pending > 0 && engine_defer(client, &op)) {
+		return;
+	}
+	reply_integer(client, getScore(item_id));
 }
 
-void command_info(int fd, token_t *tokens) {
-	char out[128];
+void command_info(struct client *client, token_t *tokens) {
+	// Reports the client's earlier updates once the engine has applied
+	// them, tokens is NULL when called from command_complete.
+	struct engine_op op = { .type = ENGINE_INFO };
+	if (tokens != NULL && client->engine_pending > 0 && engine_defer(client, &op)) {
+		return;
+	}
+	char out[4096];
+	int n = 0;
 	time_t current_time;
 	time(&current_time);
-	pthread_mutex_lock(&scores_mutex);
-	sprintf(out, "uptime:%d\r\n", (int)(current_time - app_stats.started_at)); reply(fd, out);
-	sprintf(out, "version:%s\r\n", app_stats.version); reply(fd, out);
-	sprintf(out, "updates:%u\r\n", app_stats.updates); reply(fd, out);
-	sprintf(out, "items:%u\r\n", app_stats.items); reply(fd, out);
-	sprintf(out, "pools:%u\r\n", app_stats.pools); reply(fd, out);
-	pthread_mutex_unlock(&scores_mutex);
+	uint64_t coalesce_received = stats_get(coalesce_received);
+	uint64_t coalesce_applied = stats_get(coalesce_applied);
+	n += snprintf(out + n, sizeof(out) - n, "uptime:%d\r\n", (int)(current_time - app_stats.started_at));
+	n += snprintf(out + n, sizeof(out) - n, "version:%s\r\n", app_stats.version);
+	n += snprintf(out + n, sizeof(out) - n, "updates:%" PRIu64 "\r\n", stats_get(updates));
+	n += snprintf(out + n, sizeof(out) - n, "items:%" PRIu64 "\r\n", stats_get(items));
+	n += snprintf(out + n, sizeof(out) - n, "pools:%" PRIu64 "\r\n", stats_get(pools));
+	n += snprintf(out + n, sizeof(out) - n, "connected_clients:%" PRIu64 "\r\n", stats_get(connected_clients));
+	n += snprintf(out + n, sizeof(out) - n, "rejected_clients:%" PRIu64 "\r\n", stats_get(rejected_clients));
+	n += snprintf(out + n, sizeof(out) - n, "blocked_clients:%u\r\n", blocked_clients);
+	n += snprintf(out + n, sizeof(out) - n, "total_connections_received:%" PRIu64 "\r\n", stats_get(connections));
+	n += snprintf(out + n, sizeof(out) - n, "total_commands_processed:%" PRIu64 "\r\n", stats_get(commands));
+	n += snprintf(out + n, sizeof(out) - n, "total_error_replies:%" PRIu64 "\r\n", stats_get(error_replies));
+	n += snprintf(out + n, sizeof(out) - n, "total_net_input_bytes:%" PRIu64 "\r\n", stats_get(bytes_in));
+	n += snprintf(out + n, sizeof(out) - n, "total_net_output_bytes:%" PRIu64 "\r\n", stats_get(bytes_out));
+	if (coalesce_interval > 0) {
+		n += snprintf(out + n, sizeof(out) - n, "coalesce_received:%" PRIu64 "\r\n", coalesce_received);
+		n += snprintf(out + n, sizeof(out) - n, "coalesce_applied:%" PRIu64 "\r\n", coalesce_applied);
+		n += snprintf(out + n, sizeof(out) - n, "coalesce_pending:%u\r\n", coalesce_pending());
+		n += snprintf(out + n, sizeof(out) - n, "coalesce_ratio:%.2f\r\n",
+			coalesce_applied > 0 ? (double)coalesce_received / coalesce_applied : 0.0);
+	}
+	n += snprintf(out + n, sizeof(out) - n, "udp_datagrams:%" PRIu64 "\r\n", stats_get(udp_datagrams));
+	n += snprintf(out + n, sizeof(out) - n, "udp_updates:%" PRIu64 "\r\n", stats_get(udp_updates));
+	n += snprintf(out + n, sizeof(out) - n, "udp_errors:%" PRIu64 "\r\n", stats_get(udp_errors));
+	n += snprintf(out + n, sizeof(out) - n, "udp_drops:%" PRIu64 "\r\n", stats_get(udp_drops) + app_stats.udp_kernel_drops);
+	n += snprintf(out + n, sizeof(out) - n, "snapshot_in_progress:%d\r\n", app_stats.snapshot_in_progress);
+	n += snprintf(out + n, sizeof(out) - n, "snapshot_last_status:%s\r\n", app_stats.snapshot_failed ? "err" : "ok");
+	n += snprintf(out + n, sizeof(out) - n, "snapshots:%" PRIu64 "\r\n", app_stats.snapshots);
+	n += snprintf(out + n, sizeof(out) - n, "snapshot_last_usec:%" PRIu64 "\r\n", app_stats.snapshot_usec);
+	n += snprintf(out + n, sizeof(out) - n, "snapshot_last_bytes:%" PRIu64 "\r\n", app_stats.snapshot_bytes);
+	n += snprintf(out + n, sizeof(out) - n, "snapshot_fork_usec:%" PRIu64 "\r\n", app_stats.snapshot_fork_usec);
+	n += save_info(out + n, sizeof(out) - n);
+	n += writer_info(out + n, sizeof(out) - n);
+	if (snapshot_deltas > 0) {
+		n += snprintf(out + n, sizeof(out) - n, "snapshot_last_type:%s\r\n", app_stats.snapshot_last_delta ? "delta" : "full");
+		n += snprintf(out + n, sizeof(out) - n, "snapshot_deltas:%" PRIu64 "\r\n", app_stats.snapshot_chain);
+		n += snprintf(out + n, sizeof(out) - n, "snapshot_deltas_bytes:%" PRIu64 "\r\n", app_stats.snapshot_chain_bytes);
+		n += snprintf(out + n, sizeof(out) - n, "snapshot_dirty_items:%zu\r\n", snapshot_dirty_count());
+	}
+	n += snprintf(out + n, sizeof(out) - n, "loading:%d\r\n", app_stats.loading);
+	n += snprintf(out + n, sizeof(out) - n, "loads:%" PRIu64 "\r\n", app_stats.loads);
+	n += snprintf(out + n, sizeof(out) - n, "load_last_items:%" PRIu64 "\r\n", app_stats.load_items);
+	n += snprintf(out + n, sizeof(out) - n, "load_last_usec:%" PRIu64 "\r\n", app_stats.load_usec);
+	n += snprintf(out + n, sizeof(out) - n, "load_swap_usec:%" PRIu64 "\r\n", app_stats.load_swap_usec);
+	n += snprintf(out + n, sizeof(out) - n, "load_captured:%" PRIu64 "\r\n", app_stats.load_captured);
+	if (engine_enabled) {
+		n += snprintf(out + n, sizeof(out) - n, "engine_ops:%" PRIu64 "\r\n", stats_get(engine_ops));
+		n += snprintf(out + n, sizeof(out) - n, "engine_batches:%" PRIu64 "\r\n", stats_get(engine_batches));
+		n += snprintf(out + n, sizeof(out) - n, "engine_in_flight:%u\r\n", app_stats.engine_in_flight);
+	}
+	if (journal_enabled) {
+		n += journal_info(out + n, sizeof(out) - n);
+	}
+	if (lock_profiling) {
+		n += lock_profile_info(out + n, sizeof(out) - n);
+	}
+	reply_bulk(client, out, n);
+}
+
+void command_ping(struct client *client, token_t *tokens) {
+	reply_status(client, "PONG");
+}
+
+static int format_latency(char *out, size_t size, const char *prefix, const char *name, struct latency_histogram *histogram) {
+	char lower[16];
+	size_t i;
+	for (i = 0; name[i] != '\0' && i < sizeof(lower) - 1; i++) {
+		lower[i] = name[i] | 0x20;
+	}
+	lower[i] = '\0';
+	return snprintf(out, size, "%s%s:calls=%" PRIu64 ",p50=%.2f,p99=%.2f,p999=%.2f,max=%.2f\r\n",
+		prefix, lower, __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+		latency_percentile(histogram, 50.0) / 1000.0,
+		latency_percentile(histogram, 99.0) / 1000.0,
+		latency_percentile(histogram, 99.9) / 1000.0,
+		__atomic_load_n(&histogram->max, __ATOMIC_RELAXED) / 1000.0);
+}
+
+// STATS LATENCY reports percentiles in microseconds for every command that
+// has been run, STATS LATENCY RESET clears them.
+static void stats_latency(struct client *client, int reset) {
+	char out[4096];
+	int i, n = 0;
+	if (reset) {
+		for (i = 0; i < COMMAND_COUNT; i++) {
+			latency_reset(&command_latency[i]);
+			latency_reset(&lock_latency[i]);
+		}
+		latency_reset(&engine_lock_latency);
+		reply_status(client, "OK");
+		return;
+	}
+	for (i = 0; i < COMMAND_COUNT; i++) {
+		if (command_table[i].name != NULL && command_latency[i].count > 0) {
+			n += format_latency(out + n, sizeof(out) - n, "latency_", command_table[i].name, &command_latency[i]);
+		}
+	}
+	for (i = 0; i < COMMAND_COUNT; i++) {
+		if (command_table[i].name != NULL && lock_latency[i].count > 0) {
+			n += format_latency(out + n, sizeof(out) - n, "lock_wait_", command_table[i].name, &lock_latency[i]);
+		}
+	}
+	if (engine_lock_latency.count > 0) {
+		n += format_latency(out + n, sizeof(out) - n, "lock_wait_", "ENGINE", &engine_lock_latency);
+	}
+	reply_bulk(client, out, n);
+}
+
+// STATS QUEUE reports the shape of the queue from counters the writers
+// keep up to date, so it never walks the trees or takes scores_mutex.
+static void stats_queue(struct client *client) {
+	char out[4096];
+	uint64_t pool_sizes[POOL_SIZE_BUCKETS];
+	int64_t top_age = getTopAge();
+	int i, n = 0;
+	n += snprintf(out + n, sizeof(out) - n, "items:%" PRIu64 "\r\n", stats_get(items));
+	n += snprintf(out + n, sizeof(out) - n, "pools:%" PRIu64 "\r\n", stats_get(pools));
+	getPoolSizes(pool_sizes);
+	for (i = 0; i < POOL_SIZE_BUCKETS; i++) {
+		if (pool_sizes[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			n += snprintf(out + n, sizeof(out) - n, "pool_size_1:%" PRIu64 "\r\n", pool_sizes[i]);
+		} else {
+			n += snprintf(out + n, sizeof(out) - n, "pool_size_%u_%u:%" PRIu64 "\r\n",
+				1u << i, (2u << i) - 1, pool_sizes[i]);
+		}
+	}
+	n += snprintf(out + n, sizeof(out) - n, "score_p50:%d\r\n", getScorePercentile(50.0));
+	n += snprintf(out + n, sizeof(out) - n, "score_p90:%d\r\n", getScorePercentile(90.0));
+	n += snprintf(out + n, sizeof(out) - n, "score_p99:%d\r\n", getScorePercentile(99.0));
+	n += snprintf(out + n, sizeof(out) - n, "score_max:%d\r\n", getScorePercentile(100.0));
+	n += format_latency(out + n, sizeof(out) - n, "", "wait", getWaitTimes());
+	n += snprintf(out + n, sizeof(out) - n, "top_item_age_usec:%" PRId64 "\r\n", top_age < 0 ? top_age : top_age / 1000);
+	reply_bulk(client, out, n);
+}
+
+void command_stats(struct client *client, token_t *tokens) {
+	size_t n = SUBCOMMAND_TOKEN;
+	while (tokens[n].value != NULL && tokens[n].length > 0) {
+		n++;
+	}
+	if (tokens[n].value == NULL && n == SUBCOMMAND_TOKEN + 1 && token_is(&tokens[SUBCOMMAND_TOKEN], "QUEUE")) {
+		stats_queue(client);
+		return;
+	}
+	if (tokens[n].value == NULL && token_is(&tokens[SUBCOMMAND_TOKEN], "LATENCY")) {
+		if (n == SUBCOMMAND_TOKEN + 1) {
+			stats_latency(client, 0);
+			return;
+		}
+		if (n == SUBCOMMAND_TOKEN + 2 && token_is(&tokens[SUBCOMMAND_TOKEN + 1], "RESET")) {
+			stats_latency(client, 1);
+			return;
+		}
+	}
+	reply_error(client, "ERROR");
+}
+
+// Read by the metrics endpoint, command is below COMMAND_COUNT and name is
+// NULL for slots without a command.
+const char *command_name(int command) {
+	return command_table[command].name;
+}
+
+struct latency_histogram *command_latency_histogram(int command) {
+	return &command_latency[command];
+}
+
+struct latency_histogram *command_lock_histogram(int command) {
+	return &lock_latency[command];
+}
+
+unsigned int blocked_client_count() {
+	return blocked_clients;
+}
+
+// SLOWLOG GET [count] lists the newest slow commands (10 by default) with
+// their duration in microseconds, SLOWLOG LEN counts them and SLOWLOG
+// RESET clears the log.
+void command_slowlog(struct client *client, token_t *tokens) {
+	struct slowlog_entry entries[SLOWLOG_ENTRIES];
+	char out[SLOWLOG_ENTRIES * 256];
+	int i, count = 10, n = 0, nentries;
+	size_t ntokens = SUBCOMMAND_TOKEN;
+	while (tokens[ntokens].value != NULL && tokens[ntokens].length > 0) {
+		ntokens++;
+	}
+	if (tokens[ntokens].value != NULL) {
+		reply_error(client, "ERROR");
+		return;
+	}
+	if (ntokens == SUBCOMMAND_TOKEN + 1 && token_is(&tokens[SUBCOMMAND_TOKEN], "LEN")) {
+		reply_integer(client, slowlog_len());
+		return;
+	}
+	if (ntokens == SUBCOMMAND_TOKEN + 1 && token_is(&tokens[SUBCOMMAND_TOKEN], "RESET")) {
+		slowlog_reset();
+		reply_status(client, "OK");
+		return;
+	}
+	if (ntokens < SUBCOMMAND_TOKEN + 1 || ntokens > SUBCOMMAND_TOKEN + 2 || !token_is(&tokens[SUBCOMMAND_TOKEN], "GET") ||
+			(ntokens == SUBCOMMAND_TOKEN + 2 && (parse_integer(&tokens[SUBCOMMAND_TOKEN + 1], &count) < 0 || count < 0))) {
+		reply_error(client, "ERROR");
+		return;
+	}
+	if (count > SLOWLOG_ENTRIES) {
+		count = SLOWLOG_ENTRIES;
+	}
+	nentries = slowlog_get(entries, count);
+	for (i = 0; i < nentries; i++) {
+		n += snprintf(out + n, sizeof(out) - n, "slowlog_%" PRIu64 ":time=%ld,usec=%" PRIu64 ",client=%s,command=%s%s%s\r\n",
+			entries[i].id, (long)entries[i].timestamp, entries[i].duration / 1000, entries[i].client,
+			entries[i].command, entries[i].args[0] != '\0' ? " " : "", entries[i].args);
+	}
+	reply_bulk(client, out, n);
 }
 
-// TODO: Clean the '\r\n' scrub code.
 // TODO: Add support for the 'quit' command.
-void process_request(int fd, char *input) {
-	char* nl;
-	nl = strrchr(input, '\r');
-	if (nl) { *nl = '\0'; }
-	nl = strrchr(input, '\n');
-	if (nl) { *nl = '\0'; }
+// Consumes at most one request from the front of the client's input
+// buffer. Returns the number of bytes consumed, 0 when the request is not
+// complete yet or -1 when the client sent something unparseable and should
+// be disconnected.
+int process_request(struct client *client) {
+	size_t length = EVBUFFER_LENGTH(client->input);
+	if (length == 0) {
+		return 0;
+	}
 	token_t tokens[MAX_TOKENS];
-	size_t ntokens = tokenize_command(input, tokens, MAX_TOKENS);
-	if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN].value, "UPDATE") == 0) {
-		command_update(fd, tokens);
-	} else if (ntokens == 2 && strcmp(tokens[COMMAND_TOKEN].value, "PEEK") == 0) {
-		command_peek(fd, tokens);
-	} else if (ntokens == 2 && strcmp(tokens[COMMAND_TOKEN].value, "NEXT") == 0) {
-		command_next(fd, tokens);
-	} else if (ntokens == 3 && strcmp(tokens[COMMAND_TOKEN].value, "SCORE") == 0) {
-		command_score(fd, tokens);
-	} else if (ntokens == 2 && strcmp(tokens[COMMAND_TOKEN].value, "INFO") == 0) {
-		command_info(fd, tokens);
-	} else {
-		reply(fd, "-ERROR\r\n");
+	size_t ntokens = 0;
+	request_started = latency_now();
+	int consumed = parse_request((char *)EVBUFFER_DATA(client->input), length, &client->protocol, tokens, &ntokens);
+	if (consumed < 0) {
+		reply_error(client, "ERROR PROTOCOL");
+		return -1;
+	}
+	if (consumed == 0) {
+		return 0;
 	}
+	// Tokens point into the input buffer so it is drained only after the
+	// command has been dispatched.
+	if (ntokens > 0) {
+		dispatch_command(client, tokens, ntokens);
+	}
+	evbuffer_drain(client->input, consumed);
+	return consumed;
 }
 
-size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens) {
-	char *s, *e;
-	size_t ntokens = 0;
-	for (s = e = command; ntokens < max_tokens - 1; ++e) {
-		if (*e == ' ') {
-			if (s != e) {
-				tokens[ntokens].value = s;
-				tokens[ntokens].length = e - s;
-				ntokens++;
-				*e = '\0';
-			}
-			s = e + 1;
-		} else if (*e == '\0') {
-			if (s != e) {
-				tokens[ntokens].value = s;
-				tokens[ntokens].length = e - s;
-				ntokens++;
+// Applies the UPDATE and MUPDATE requests in a datagram, which must end in
+// a line ending. Nothing is replied, failures are only counted.
+void process_datagram(char *data, size_t length) {
+	token_t tokens[MAX_TOKENS];
+	size_t ntokens, n;
+	int protocol, consumed, command;
+	while (length > 0) {
+		consumed = parse_request(data, length, &protocol, tokens, &ntokens);
+		if (consumed <= 0) {
+			stats_add(udp_errors, 1);
+			return;
+		}
+		data += consumed;
+		length -= consumed;
+		if (ntokens <= 1) {
+			continue;
+		}
+		command = lookup_command(tokens[COMMAND_TOKEN].value, tokens[COMMAND_TOKEN].length);
+		n = ntokens - 1 - KEY_TOKEN;
+		stats_add(commands, 1);
+		current_command = command;
+		if ((command == COMMAND_UPDATE && n == 2) ||
+				(command == COMMAND_MUPDATE && n > 0 && n % 2 == 0 && tokens[ntokens - 1].value == NULL)) {
+			if (apply_updates(&tokens[KEY_TOKEN], n / 2) == NULL) {
+				stats_add(udp_updates, n / 2);
+				continue;
 			}
-			break;
 		}
+		stats_add(udp_errors, 1);
+	}
+}
+
+static void dispatch_now(struct client *client, token_t *tokens, size_t ntokens) {
+	stats_add(commands, 1);
+	if (respond_empty == 1) {
+		// Inline clients have always been sent a bare "-1" while the
+		// server shuts down, RESP clients get a proper error reply.
+		reply_error(client, client->protocol == PROTOCOL_RESP ? "SHUTDOWN in progress" : "1");
+		return;
+	}
+	struct command *command = &command_table[lookup_command(tokens[COMMAND_TOKEN].value, tokens[COMMAND_TOKEN].length)];
+	if (command->handler == NULL || (command->ntokens != 0 && command->ntokens != ntokens)) {
+		reply_error(client, "ERROR");
+		return;
+	}
+	current_command = command - command_table;
+	request_deferred = 0;
+	command->handler(client, tokens);
+	if (!request_deferred) {
+		command_done(client, current_command, latency_now() - request_started, tokens, ntokens, NULL);
 	}
-	tokens[ntokens].value =  *e == '\0' ? NULL : e;
-	tokens[ntokens].length = 0;
-	ntokens++;
-	return ntokens;
 }
 
-void reply(int fd, char *buffer) {
-	int n = write(fd, buffer, strlen(buffer));
-	if (n < 0 || n < strlen(buffer)) {
-		printf("ERROR writing to socket");
+void dispatch_command(struct client *client, token_t *tokens, size_t ntokens) {
+	if (client->engine_pending == 0) {
+		dispatch_now(client, tokens, ntokens);
+		return;
+	}
+	// Replies leave in request order, so one produced right away while
+	// earlier requests are still with the engine thread is passed through
+	// it behind them.
+	struct evbuffer *output = client->output;
+	if (client->held == NULL && (client->held = evbuffer_new()) == NULL) {
+		err(1, "malloc failed");
+	}
+	client->output = client->held;
+	dispatch_now(client, tokens, ntokens);
+	client->output = output;
+	if (EVBUFFER_LENGTH(client->held) == 0) {
+		return;
+	}
+	struct engine_op op = { .type = ENGINE_NOP, .client = client, .reply = client->held };
+	if (engine_submit(&op, 1) < 0) {
+		err(1, "engine reserve exhausted");
+	}
+	client->held = NULL;
+	client->engine_pending++;
+}
+
+void reply_status(struct client *client, const char *status) {
+	evbuffer_add_printf(client->output, "+%s\r\n", status);
+}
+
+void reply_error(struct client *client, const char *message) {
+	stats_add(error_replies, 1);
+	evbuffer_add_printf(client->output, "-%s\r\n", message);
+}
+
+// Inline clients have always received numbers as status replies.
+void reply_integer(struct client *client, int value) {
+	evbuffer_add_printf(client->output, client->protocol == PROTOCOL_RESP ? ":%d\r\n" : "+%d\r\n", value);
+}
+
+// Multi-line replies are sent raw to inline clients and as a bulk string to
+// RESP clients.
+void reply_bulk(struct client *client, const char *data, size_t length) {
+	if (client->protocol == PROTOCOL_RESP) {
+		evbuffer_add_printf(client->output, "$%d\r\n", (int)length);
+		evbuffer_add(client->output, data, length);
+		evbuffer_add(client->output, "\r\n", 2);
+	} else if (length > 0) {
+		evbuffer_add(client->output, data, length);
+	} else {
+		// Inline replies are line based, an empty one is a blank line.
+		evbuffer_add(client->output, "\r\n", 2);
 	}
 }
@@ -25,24 +25,47 @@ THE SOFTWARE.
 #ifndef __COMMANDS_H__
 #define __COMMANDS_H__
 
-#define COMMAND_TOKEN		0
-#define SUBCOMMAND_TOKEN	1
-#define KEY_TOKEN			1
-#define VALUE_TOKEN			2
-#define MAX_TOKENS			8
-
-typedef struct token_s {
-	char *value;
-	size_t length;
-} token_t;
-
-void command_update(int fd, token_t *tokens);
-void command_next(int fd, token_t *tokens);
-void command_peek(int fd, token_t *tokens);
-void command_score(int fd, token_t *tokens);
-void command_info(int fd, token_t *tokens);
-void process_request(int fd, char *input);
-size_t tokenize_command(char *command, token_t *tokens, const size_t max_tokens);
-void reply(int fd, char *buffer);
+#include "protocol.h"
+
+struct client;
+struct engine_op;
+struct latency_histogram;
+
+typedef void (*command_handler)(struct client *client, token_t *tokens);
+
+struct command {
+	const char *name;
+	size_t ntokens;
+	command_handler handler;
+};
+
+void command_update(struct client *client, token_t *tokens);
+void command_mupdate(struct client *client, token_t *tokens);
+void command_next(struct client *client, token_t *tokens);
+void command_bnext(struct client *client, token_t *tokens);
+void command_peek(struct client *client, token_t *tokens);
+void command_score(struct client *client, token_t *tokens);
+void command_info(struct client *client, token_t *tokens);
+void command_ping(struct client *client, token_t *tokens);
+void command_stats(struct client *client, token_t *tokens);
+void command_slowlog(struct client *client, token_t *tokens);
+void on_bnext_timeout(int fd, short ev, void *arg);
+void unblock_client(struct client *client);
+void serve_waiters();
+void command_complete(struct engine_op *op);
+void process_completed();
+const char *command_name(int command);
+struct latency_histogram *command_latency_histogram(int command);
+struct latency_histogram *command_lock_histogram(int command);
+unsigned int blocked_client_count();
+const char *apply_updates(token_t *tokens, size_t npairs);
+int process_request(struct client *client);
+void process_datagram(char *data, size_t length);
+void dispatch_command(struct client *client, token_t *tokens, size_t ntokens);
+
+void reply_status(struct client *client, const char *status);
+void reply_error(struct client *client, const char *message);
+void reply_integer(struct client *client, int value);
+void reply_bulk(struct client *client, const char *data, size_t length);
 
 #endif
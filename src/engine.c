@@ -0,0 +1,282 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/*
+ * Single writer engine thread, enabled with --engine-thread.
+ *
+ * The engine thread is the only thread that runs queue operations, so the
+ * queue stays hot in one core's cache. The network thread submits parsed
+ * commands through a lock-free multi-producer ring and gets the results
+ * back through a completion ring. The engine takes scores_mutex once per
+ * batch of up to ENGINE_BATCH operations, which keeps snapshots and
+ * snapshot loads consistent. The network thread is woken once per batch
+ * of completions through a pipe.
+ *
+ * Every submitted operation produces exactly one completion, and no more
+ * than ENGINE_RING_SIZE operations are in flight at once, so neither ring
+ * can overflow.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "barbershop.h"
+#include "commands.h"
+#include "engine.h"
+#include "journal.h"
+#include "lockprof.h"
+#include "pqueue.h"
+#include "stats.h"
+
+#define CACHE_LINE 64
+
+// Bounded queue after Dmitry Vyukov's design. Each slot carries a sequence
+// number telling producers and the consumer whose turn it is, so producers
+// only contend on the tail.
+struct engine_slot {
+	unsigned long sequence;
+	struct engine_op op;
+};
+
+struct engine_ring {
+	struct engine_slot *slots;
+	unsigned long mask;
+	char pad0[CACHE_LINE];
+	unsigned long head;
+	char pad1[CACHE_LINE];
+	unsigned long tail;
+	char pad2[CACHE_LINE];
+};
+
+static struct engine_ring submissions;
+static struct engine_ring completions;
+
+// Only touched by the network thread.
+static int in_flight = 0;
+
+static pthread_mutex_t engine_sleep_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t engine_wakeup = PTHREAD_COND_INITIALIZER;
+static int engine_sleeping = 0;
+
+static int notify_pipe[2];
+static int network_notified = 0;
+static struct event ev_completions;
+
+static void ring_init(struct engine_ring *ring, unsigned long size)
+{
+	unsigned long i;
+	ring->slots = calloc(size, sizeof(struct engine_slot));
+	if (ring->slots == NULL) {
+		err(1, "malloc failed");
+	}
+	for (i = 0; i < size; i++) {
+		ring->slots[i].sequence = i;
+	}
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+}
+
+static int ring_push(struct engine_ring *ring, struct engine_op *op)
+{
+	struct engine_slot *slot;
+	unsigned long pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	while (1) {
+		slot = &ring->slots[pos & ring->mask];
+		long diff = (long)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+	slot->op = *op;
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Single consumer.
+static int ring_pop(struct engine_ring *ring, struct engine_op *op)
+{
+	struct engine_slot *slot = &ring->slots[ring->head & ring->mask];
+	if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1) {
+		return 0;
+	}
+	*op = slot->op;
+	__atomic_store_n(&slot->sequence, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+	ring->head++;
+	return 1;
+}
+
+static int ring_empty(struct engine_ring *ring)
+{
+	struct engine_slot *slot = &ring->slots[ring->head & ring->mask];
+	return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1;
+}
+
+static void engine_execute(struct engine_op *op)
+{
+	int i;
+	switch (op->type) {
+		case ENGINE_UPDATE:
+			op->result = 0;
+			for (i = 0; i < op->npairs; i++) {
+				if (journal_update(op->item_ids[i], op->scores[i]) < 0) {
+					op->result = -1;
+				}
+			}
+			break;
+		case ENGINE_NEXT:
+			op->result = journal_next();
+			break;
+		case ENGINE_PEEK:
+			op->result = peekNext();
+			break;
+		case ENGINE_SCORE:
+			op->result = getScore(op->item_ids[0]);
+			break;
+	}
+}
+
+// Spins briefly before sleeping since submissions tend to come in bursts.
+static void engine_wait()
+{
+	int i;
+	for (i = 0; i < ENGINE_SPIN; i++) {
+		if (!ring_empty(&submissions)) {
+			return;
+		}
+		sched_yield();
+	}
+	pthread_mutex_lock(&engine_sleep_mutex);
+	__atomic_store_n(&engine_sleeping, 1, __ATOMIC_SEQ_CST);
+	while (ring_empty(&submissions)) {
+		pthread_cond_wait(&engine_wakeup, &engine_sleep_mutex);
+	}
+	__atomic_store_n(&engine_sleeping, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&engine_sleep_mutex);
+}
+
+static void *engine_thread(void *arg)
+{
+	static struct engine_op batch[ENGINE_BATCH];
+	int i, n;
+	char byte = 0;
+	while (1) {
+		n = 0;
+		while (n < ENGINE_BATCH && ring_pop(&submissions, &batch[n])) {
+			n++;
+		}
+		if (n == 0) {
+			engine_wait();
+			continue;
+		}
+		latency_record(&engine_lock_latency, scores_lock(LOCK_SITE_ENGINE));
+		for (i = 0; i < n; i++) {
+			engine_execute(&batch[i]);
+		}
+		stats_add(engine_ops, n);
+		stats_add(engine_batches, 1);
+		scores_unlock(LOCK_SITE_ENGINE);
+		for (i = 0; i < n; i++) {
+			ring_push(&completions, &batch[i]);
+		}
+		if (!__atomic_exchange_n(&network_notified, 1, __ATOMIC_SEQ_CST)) {
+			if (write(notify_pipe[1], &byte, 1) < 0 && errno != EAGAIN) {
+				warn("engine notify failed");
+			}
+		}
+	}
+	return NULL;
+}
+
+static void on_engine_completions(int fd, short ev, void *arg)
+{
+	char buf[64];
+	struct engine_op op;
+	while (read(fd, buf, sizeof(buf)) > 0);
+	// Cleared before draining so completions pushed from here on trigger
+	// another wakeup.
+	__atomic_store_n(&network_notified, 0, __ATOMIC_SEQ_CST);
+	while (ring_pop(&completions, &op)) {
+		in_flight--;
+		app_stats.engine_in_flight = in_flight;
+		command_complete(&op);
+	}
+	process_completed();
+}
+
+void engine_init()
+{
+	pthread_t engine;
+	ring_init(&submissions, ENGINE_RING_SIZE);
+	ring_init(&completions, ENGINE_RING_SIZE);
+	if (pipe(notify_pipe) < 0 || setnonblock(notify_pipe[0]) < 0 || setnonblock(notify_pipe[1]) < 0) {
+		err(1, "engine pipe failed");
+	}
+	event_set(&ev_completions, notify_pipe[0], EV_READ|EV_PERSIST, on_engine_completions, NULL);
+	event_add(&ev_completions, NULL);
+	engine_enabled = 1;
+	if (pthread_create(&engine, NULL, engine_thread, NULL) != 0) {
+		err(1, "engine thread failed");
+	}
+}
+
+// Operations the network thread may still submit without using the
+// reserved slots.
+int engine_capacity()
+{
+	int free_slots = ENGINE_RING_SIZE - ENGINE_RESERVED - in_flight;
+	return free_slots > 0 ? free_slots : 0;
+}
+
+// Called from the network thread only. Returns -1 without submitting when
+// the engine is full.
+int engine_submit(struct engine_op *op, int reserved)
+{
+	if (in_flight >= (reserved ? ENGINE_RING_SIZE : ENGINE_RING_SIZE - ENGINE_RESERVED)) {
+		return -1;
+	}
+	ring_push(&submissions, op);
+	in_flight++;
+	app_stats.engine_in_flight = in_flight;
+	// Pairs with the store of engine_sleeping so either the engine sees the
+	// new operation or we see it asleep.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&engine_sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&engine_sleep_mutex);
+		pthread_cond_signal(&engine_wakeup);
+		pthread_mutex_unlock(&engine_sleep_mutex);
+	}
+	return 0;
+}
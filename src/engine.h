@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+
+#include "latency.h"
+#include "protocol.h"
+
+// Operations in flight between the network thread and the engine thread.
+// ENGINE_RESERVED slots are kept for operations that can not be put off,
+// such as replies held behind earlier operations.
+#define ENGINE_RING_SIZE	16384
+#define ENGINE_RESERVED		1024
+#define ENGINE_BATCH		256
+#define ENGINE_SPIN			1000
+#define ENGINE_MAX_PAIRS	(MAX_TOKENS / 2)
+
+enum engine_op_type {
+	ENGINE_NOP = 0,
+	ENGINE_UPDATE,
+	ENGINE_NEXT,
+	ENGINE_PEEK,
+	ENGINE_SCORE,
+	ENGINE_INFO
+};
+
+// ENGINE_NEXT issued by BNEXT, or to hand an item to a blocked client.
+#define ENGINE_FLAG_BNEXT	1
+#define ENGINE_FLAG_WAKE	2
+
+struct client;
+struct evbuffer;
+
+struct engine_op {
+	int type;
+	int flags;
+	struct client *client;
+	// Reply held back until the operations before it complete (ENGINE_NOP)
+	struct evbuffer *reply;
+	// BNEXT timeout in seconds
+	int timeout;
+	int result;
+	// Request the operation answers and when parsing it started, 0 for
+	// operations no request waits on
+	int command;
+	uint64_t started;
+	int npairs;
+	int item_ids[ENGINE_MAX_PAIRS];
+	int scores[ENGINE_MAX_PAIRS];
+};
+
+int engine_enabled;
+// Time the engine thread waited for scores_mutex per batch
+struct latency_histogram engine_lock_latency;
+
+void engine_init();
+int engine_capacity();
+int engine_submit(struct engine_op *op, int reserved);
+
+#endif
@@ -0,0 +1,499 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "pqueue.h"
+#include "snapshot.h"
+#include "stats.h"
+
+// Records buffered before the first flush, the buffer doubles from there.
+#define JOURNAL_BUFFER	4096
+
+// journal_mutex guards the buffer being appended to and the file it goes
+// to. flush_mutex is held by whoever writes records out, so they reach the
+// file in the order they were appended.
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct journal_record *records = NULL;
+static size_t used = 0, capacity = 0;
+// The buffer being written out, swapped with records on every flush.
+static struct journal_record *spare = NULL;
+static size_t spare_capacity = 0;
+static int journal_fd = -1;
+static char *journal_base = NULL;
+static uint64_t generation = 0;
+// Records appended, written out and made durable so far.
+static uint64_t appended = 0, written = 0, synced = 0;
+static uint64_t fsyncs = 0, replayed = 0, errors = 0;
+// Left behind by journal_rotate for journal_retire.
+static struct journal_record *retired = NULL;
+static int retired_fd = -1;
+static size_t retired_count = 0;
+static uint64_t retired_target = 0;
+// Changes made while a snapshot loads, applied on top of it once it is in
+// place. Only touched under scores_mutex.
+static struct journal_record *captured = NULL;
+static size_t captured_count = 0, captured_capacity = 0;
+static int capturing = 0;
+
+static void journal_filename(char *out, size_t size, uint64_t generation)
+{
+	snprintf(out, size, "%s.journal.%" PRIu64, journal_base, generation);
+}
+
+static int journal_open(uint64_t generation)
+{
+	char filename[4096];
+	journal_filename(filename, sizeof(filename), generation);
+	return open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+// Losing the journal breaks the promise made to clients that were already
+// answered under the always policy, so that stops the server.
+static void journal_failed(const char *what)
+{
+	if (journal_fsync == JOURNAL_FSYNC_ALWAYS) {
+		err(1, "journal %s failed", what);
+	}
+	warn("journal %s failed", what);
+	__atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static int write_all(int fd, const void *data, size_t length)
+{
+	const char *next = data;
+	ssize_t n;
+	while (length > 0) {
+		n = write(fd, next, length);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		next += n;
+		length -= n;
+	}
+	return 0;
+}
+
+// Takes the records appended so far. Called holding both mutexes.
+static size_t take_records(struct journal_record **batch)
+{
+	size_t count = used, batch_capacity = capacity;
+	*batch = records;
+	records = spare;
+	capacity = spare_capacity;
+	used = 0;
+	spare = *batch;
+	spare_capacity = batch_capacity;
+	return count;
+}
+
+static void write_records(int fd, struct journal_record *batch, size_t count, uint64_t target, int sync)
+{
+	if (count > 0 && write_all(fd, batch, count * sizeof(*batch)) < 0) {
+		journal_failed("write");
+		return;
+	}
+	__atomic_store_n(&written, target, __ATOMIC_RELAXED);
+	if (sync && __atomic_load_n(&synced, __ATOMIC_RELAXED) != target) {
+		if (fdatasync(fd) < 0) {
+			journal_failed("fsync");
+			return;
+		}
+		__atomic_add_fetch(&fsyncs, 1, __ATOMIC_RELAXED);
+	}
+	if (sync) {
+		__atomic_store_n(&synced, target, __ATOMIC_RELEASE);
+	}
+}
+
+// Writes out the records appended so far, and makes them durable if sync
+// is set. Called holding flush_mutex.
+static void flush_records(int sync)
+{
+	struct journal_record *batch;
+	size_t count;
+	uint64_t target;
+	int fd;
+	pthread_mutex_lock(&journal_mutex);
+	count = take_records(&batch);
+	target = appended;
+	fd = journal_fd;
+	pthread_mutex_unlock(&journal_mutex);
+	write_records(fd, batch, count, target, sync);
+}
+
+static void journal_append(int type, int item_id, int score)
+{
+	struct journal_record *record;
+	pthread_mutex_lock(&journal_mutex);
+	if (used == capacity) {
+		size_t grown = capacity > 0 ? capacity * 2 : JOURNAL_BUFFER;
+		struct journal_record *larger = realloc(records, grown * sizeof(*records));
+		if (larger == NULL) {
+			err(1, "could not grow the journal buffer");
+		}
+		records = larger;
+		capacity = grown;
+	}
+	record = &records[used++];
+	record->type = type;
+	record->item_id = item_id;
+	record->score = score;
+	__atomic_store_n(&appended, appended + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&journal_mutex);
+}
+
+static void capture(int type, int item_id, int score)
+{
+	if (captured_count == captured_capacity) {
+		size_t grown = captured_capacity > 0 ? captured_capacity * 2 : JOURNAL_BUFFER;
+		struct journal_record *larger = realloc(captured, grown * sizeof(*captured));
+		if (larger == NULL) {
+			err(1, "could not grow the capture buffer");
+		}
+		captured = larger;
+		captured_capacity = grown;
+	}
+	captured[captured_count].type = type;
+	captured[captured_count].item_id = item_id;
+	captured[captured_count].score = score;
+	captured_count++;
+}
+
+// Applies the changes made to the queue through the journal, callers hold
+// scores_mutex so records are appended in the order they were applied.
+// Delta snapshots track the items changed here too.
+int journal_update(int item_id, int score)
+{
+	int rval = update(item_id, score);
+	if (rval < 0) {
+		return rval;
+	}
+	__atomic_store_n(&app_stats.changes, app_stats.changes + 1, __ATOMIC_RELAXED);
+	if (journal_enabled) {
+		journal_append(JOURNAL_UPDATE, item_id, score);
+	}
+	if (capturing) {
+		capture(JOURNAL_UPDATE, item_id, score);
+	}
+	if (snapshot_deltas > 0) {
+		snapshot_track(item_id);
+	}
+	return rval;
+}
+
+// NEXT is journaled as the removal of the item it returned.
+int journal_next()
+{
+	int item_id = getNext();
+	if (item_id == -1) {
+		return item_id;
+	}
+	__atomic_store_n(&app_stats.changes, app_stats.changes + 1, __ATOMIC_RELAXED);
+	if (journal_enabled) {
+		journal_append(JOURNAL_DELETE, item_id, 0);
+	}
+	if (capturing) {
+		capture(JOURNAL_DELETE, item_id, 0);
+	}
+	if (snapshot_deltas > 0) {
+		snapshot_track(item_id);
+	}
+	return item_id;
+}
+
+// Under the always policy replies wait while this is set, so the records
+// behind them are made durable by one journal_commit for all of them.
+int journal_uncommitted()
+{
+	if (!journal_enabled || journal_fsync != JOURNAL_FSYNC_ALWAYS) {
+		return 0;
+	}
+	return __atomic_load_n(&synced, __ATOMIC_ACQUIRE) != __atomic_load_n(&appended, __ATOMIC_ACQUIRE);
+}
+
+void journal_commit()
+{
+	pthread_mutex_lock(&flush_mutex);
+	flush_records(1);
+	pthread_mutex_unlock(&flush_mutex);
+}
+
+static void *journal_thread(void *arg)
+{
+	int interval = journal_fsync > 0 ? journal_fsync : DEFAULT_JOURNAL_FSYNC_MS;
+	struct timespec delay = { interval / 1000, (interval % 1000) * 1000000L };
+	while (1) {
+		nanosleep(&delay, NULL);
+		pthread_mutex_lock(&flush_mutex);
+		flush_records(journal_fsync != JOURNAL_FSYNC_NEVER);
+		pthread_mutex_unlock(&flush_mutex);
+	}
+	return NULL;
+}
+
+static int apply_record(const struct journal_record *record)
+{
+	if (record->type == JOURNAL_UPDATE) {
+		update(record->item_id, record->score);
+	} else if (record->type == JOURNAL_DELETE) {
+		removeItem(record->item_id);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t replay(const char *filename)
+{
+	struct journal_record record;
+	uint64_t count = 0;
+	FILE *in = fopen(filename, "r");
+	if (in == NULL) {
+		warn("could not replay %s", filename);
+		return 0;
+	}
+	// A record cut short by a crash was never acknowledged, so reading
+	// stops there.
+	while (fread(&record, sizeof(record), 1, in) == 1) {
+		if (apply_record(&record) < 0) {
+			warnx("%s: unknown journal record, ignoring the rest", filename);
+			break;
+		}
+		count++;
+	}
+	fclose(in);
+	return count;
+}
+
+static int compare_generations(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Lists the generations of the journals next to the snapshot, oldest
+// first. Returns the number found.
+static size_t list_generations(uint64_t **generations)
+{
+	char pattern[4096], *end;
+	glob_t found;
+	size_t i, n = 0, prefix;
+	journal_filename(pattern, sizeof(pattern), 0);
+	prefix = strlen(pattern) - 1;
+	strcpy(pattern + prefix, "*");
+	*generations = NULL;
+	if (glob(pattern, 0, NULL, &found) != 0) {
+		return 0;
+	}
+	*generations = malloc(found.gl_pathc * sizeof(**generations));
+	if (*generations == NULL) {
+		err(1, "could not list journals");
+	}
+	for (i = 0; i < found.gl_pathc; i++) {
+		const char *suffix = found.gl_pathv[i] + prefix;
+		uint64_t value = strtoull(suffix, &end, 10);
+		if (end != suffix && *end == '\0') {
+			(*generations)[n++] = value;
+		}
+	}
+	globfree(&found);
+	qsort(*generations, n, sizeof(**generations), compare_generations);
+	return n;
+}
+
+// Opens a journal for the generation after the snapshot and the journals
+// already there, before the snapshot is loaded. journal_replay applies
+// those once it is.
+void journal_init(const char *snapshot, uint64_t snapshot_generation)
+{
+	uint64_t *generations;
+	size_t n;
+	pthread_t thread;
+	generation = snapshot_generation;
+	if (!journal_enabled) {
+		return;
+	}
+	if ((journal_base = strdup(snapshot)) == NULL) {
+		err(1, "journal_init");
+	}
+	n = list_generations(&generations);
+	if (n > 0 && generations[n - 1] >= generation) {
+		generation = generations[n - 1] + 1;
+	}
+	free(generations);
+	if ((journal_fd = journal_open(generation)) < 0) {
+		err(1, "could not open journal");
+	}
+	if (pthread_create(&thread, NULL, journal_thread, NULL) != 0) {
+		errx(1, "could not start the journal thread");
+	}
+	pthread_detach(thread);
+}
+
+// Called under scores_mutex once the snapshot of the given generation is
+// loaded. Replays the journals it does not cover up to the one opened by
+// journal_init and removes the ones it does. Returns the number of
+// changes replayed.
+uint64_t journal_replay(uint64_t snapshot_generation)
+{
+	char filename[4096];
+	uint64_t *generations, count = 0;
+	size_t i, n;
+	if (!journal_enabled) {
+		return 0;
+	}
+	n = list_generations(&generations);
+	for (i = 0; i < n && generations[i] < generation; i++) {
+		journal_filename(filename, sizeof(filename), generations[i]);
+		if (generations[i] < snapshot_generation) {
+			unlink(filename);
+		} else {
+			count += replay(filename);
+		}
+	}
+	free(generations);
+	replayed += count;
+	return count;
+}
+
+// Called under scores_mutex when a snapshot starts loading.
+void journal_capture_begin()
+{
+	capturing = 1;
+}
+
+// Called under scores_mutex once the snapshot is loaded. Applies the
+// changes captured meanwhile to the queue now in place if apply is set and
+// returns how many there were.
+size_t journal_capture_end(int apply)
+{
+	size_t i, count = captured_count;
+	for (i = 0; apply && i < count; i++) {
+		apply_record(&captured[i]);
+	}
+	free(captured);
+	captured = NULL;
+	captured_count = 0;
+	captured_capacity = 0;
+	capturing = 0;
+	return count;
+}
+
+// Snapshots record the generation they were taken at.
+uint64_t journal_generation()
+{
+	return __atomic_load_n(&generation, __ATOMIC_RELAXED);
+}
+
+// Starts the next generation for a snapshot about to be taken under
+// scores_mutex, so the changes after it go to a journal the snapshot does
+// not cover. The records still buffered for the previous journal are
+// written out by journal_retire once the caller released scores_mutex,
+// other flushes wait until then. Returns -1 if the next journal could not
+// be created, in which case the snapshot must not be taken.
+int journal_rotate()
+{
+	int fd;
+	if (!journal_enabled) {
+		__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	pthread_mutex_lock(&flush_mutex);
+	if ((fd = journal_open(generation + 1)) < 0) {
+		pthread_mutex_unlock(&flush_mutex);
+		journal_failed("rotation");
+		return -1;
+	}
+	pthread_mutex_lock(&journal_mutex);
+	retired_count = take_records(&retired);
+	retired_target = appended;
+	retired_fd = journal_fd;
+	journal_fd = fd;
+	__atomic_add_fetch(&generation, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&journal_mutex);
+	return 0;
+}
+
+void journal_retire()
+{
+	if (!journal_enabled) {
+		return;
+	}
+	write_records(retired_fd, retired, retired_count, retired_target, journal_fsync != JOURNAL_FSYNC_NEVER);
+	close(retired_fd);
+	retired_fd = -1;
+	pthread_mutex_unlock(&flush_mutex);
+}
+
+// Removes the journals covered by a snapshot of the given generation now
+// in place.
+void journal_compact(uint64_t snapshot_generation)
+{
+	char filename[4096];
+	uint64_t *generations;
+	size_t i, n;
+	if (!journal_enabled) {
+		return;
+	}
+	n = list_generations(&generations);
+	for (i = 0; i < n && generations[i] < snapshot_generation; i++) {
+		journal_filename(filename, sizeof(filename), generations[i]);
+		unlink(filename);
+	}
+	free(generations);
+}
+
+int journal_info(char *out, size_t size)
+{
+	// Read before the total, which only moves ahead of them.
+	uint64_t durable = __atomic_load_n(&synced, __ATOMIC_ACQUIRE);
+	uint64_t flushed = __atomic_load_n(&written, __ATOMIC_RELAXED);
+	uint64_t total = __atomic_load_n(&appended, __ATOMIC_ACQUIRE);
+	return snprintf(out, size,
+		"journal_generation:%" PRIu64 "\r\n"
+		"journal_records:%" PRIu64 "\r\n"
+		"journal_replayed:%" PRIu64 "\r\n"
+		"journal_unwritten:%" PRIu64 "\r\n"
+		"journal_unsynced:%" PRIu64 "\r\n"
+		"journal_fsyncs:%" PRIu64 "\r\n"
+		"journal_errors:%" PRIu64 "\r\n",
+		journal_generation(), total, replayed,
+		total - flushed, total - durable,
+		__atomic_load_n(&fsyncs, __ATOMIC_RELAXED),
+		__atomic_load_n(&errors, __ATOMIC_RELAXED));
+}
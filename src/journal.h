@@ -0,0 +1,69 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fsync policies for --journal-fsync, which otherwise gives the interval
+// in milliseconds between fsyncs.
+#define JOURNAL_FSYNC_ALWAYS	0
+#define JOURNAL_FSYNC_NEVER		-1
+#define DEFAULT_JOURNAL_FSYNC_MS	1000
+
+#define JOURNAL_UPDATE	1
+#define JOURNAL_DELETE	2
+
+// Every change to the queue since the last snapshot is appended to
+// "<snapshot>.journal.<generation>" as one record in host byte order. A
+// snapshot starts a new generation, records it in its header and removes
+// the journals it covers once it is in place. Startup replays the
+// journals of the snapshot's generation and later on top of it. Changes
+// made while a snapshot loads are also captured in memory, to be applied
+// on top of it once it replaces the queue being served.
+struct journal_record {
+	int32_t type;
+	int32_t item_id;
+	int32_t score;
+};
+
+// Set by --journal and --journal-fsync.
+int journal_enabled;
+int journal_fsync;
+
+void journal_init(const char *snapshot, uint64_t generation);
+uint64_t journal_replay(uint64_t generation);
+void journal_capture_begin();
+size_t journal_capture_end(int apply);
+uint64_t journal_generation();
+int journal_update(int item_id, int score);
+int journal_next();
+int journal_uncommitted();
+void journal_commit();
+int journal_rotate();
+void journal_retire();
+void journal_compact(uint64_t generation);
+int journal_info(char *out, size_t size);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include "latency.h"
+
+void latency_record(struct latency_histogram *histogram, uint64_t ns)
+{
+	uint64_t *bucket = &histogram->buckets[latency_bucket(ns)];
+	__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->sum, histogram->sum + ns, __ATOMIC_RELAXED);
+	if (ns > histogram->max) {
+		__atomic_store_n(&histogram->max, ns, __ATOMIC_RELAXED);
+	}
+}
+
+// Returns the nearest rank, from 1 to count, of the value at or below which
+// the given percentage of count values fall, so the p99 of two values is
+// the larger one. count must not be 0.
+uint64_t latency_rank(uint64_t count, double percentile)
+{
+	// Rounds the rank up, ignoring the rounding error of the product so
+	// that the p99.9 of 41000 values is not pushed one rank too high.
+	double rank = count * percentile / 100.0;
+	uint64_t target = (uint64_t)rank;
+	if (rank - target > rank * 1e-12) {
+		target++;
+	}
+	if (target == 0) {
+		return 1;
+	}
+	return target < count ? target : count;
+}
+
+// Returns the value at or below which the given percentage of recorded
+// values fall, capped at the exact maximum.
+uint64_t latency_percentile(struct latency_histogram *histogram, double percentile)
+{
+	uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+	uint64_t target, seen = 0, value;
+	unsigned int i;
+	if (count == 0) {
+		return 0;
+	}
+	target = latency_rank(count, percentile);
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target) {
+			value = latency_bucket_value(i);
+			return value < max ? value : max;
+		}
+	}
+	return max;
+}
+
+// Racing with the writer may leave a stray count behind, which is fine
+// for monitoring.
+// Fills counts[i] with the number of values recorded in buckets whose
+// highest value is at or below bounds[i], bounds must be ascending.
+// Returns the total, which is consistent with counts unlike count.
+uint64_t latency_cumulative(struct latency_histogram *histogram, const uint64_t *bounds, size_t nbounds, uint64_t *counts)
+{
+	uint64_t seen = 0;
+	unsigned int i;
+	size_t bound = 0;
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		uint64_t value = latency_bucket_value(i);
+		while (bound < nbounds && value > bounds[bound]) {
+			counts[bound++] = seen;
+		}
+		seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+	}
+	while (bound < nbounds) {
+		counts[bound++] = seen;
+	}
+	return seen;
+}
+
+void latency_reset(struct latency_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+}
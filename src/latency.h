@@ -0,0 +1,85 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Log-linear buckets: values below 16ns get a bucket each, above that
+// every power of two is split into 16 buckets, so a recorded value is off
+// by at most 1/16th. The last bucket also takes everything above ~18
+// minutes.
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		(LATENCY_SUB_BUCKETS * 38)
+
+// Each histogram has a single writer and is read with relaxed loads.
+struct latency_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[LATENCY_BUCKETS];
+};
+
+static inline uint64_t latency_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline unsigned int latency_bucket(uint64_t ns)
+{
+	unsigned int index;
+	int exponent;
+	if (ns < LATENCY_SUB_BUCKETS) {
+		return ns;
+	}
+	exponent = 63 - __builtin_clzll(ns);
+	index = (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS +
+		((ns >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+	return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Highest value that falls into a bucket.
+static inline uint64_t latency_bucket_value(unsigned int index)
+{
+	unsigned int exponent, sub;
+	if (index < LATENCY_SUB_BUCKETS) {
+		return index;
+	}
+	exponent = index / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+	sub = index % LATENCY_SUB_BUCKETS;
+	return (((uint64_t)LATENCY_SUB_BUCKETS + sub + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+void latency_record(struct latency_histogram *histogram, uint64_t ns);
+uint64_t latency_rank(uint64_t count, double percentile);
+uint64_t latency_percentile(struct latency_histogram *histogram, double percentile);
+uint64_t latency_cumulative(struct latency_histogram *histogram, const uint64_t *bounds, size_t nbounds, uint64_t *counts);
+void latency_reset(struct latency_histogram *histogram);
+
+#endif
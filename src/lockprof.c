@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/*
+ * scores_mutex profiling, enabled with --lock-profiling. Counts
+ * acquisitions, contended acquisitions, time spent waiting and time the
+ * lock was held per call site, so a slow snapshot or reload shows up
+ * next to the commands it stalled. When disabled the only extra cost is
+ * a trylock before blocking.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "barbershop.h"
+#include "latency.h"
+#include "lockprof.h"
+
+static const char *lock_site_names[LOCK_SITE_COUNT] = {
+	[LOCK_SITE_UPDATE] = "update",
+	[LOCK_SITE_NEXT] = "next",
+	[LOCK_SITE_COALESCE] = "coalesce",
+	[LOCK_SITE_ENGINE] = "engine",
+	[LOCK_SITE_SNAPSHOT] = "snapshot",
+	[LOCK_SITE_RELOAD] = "reload",
+};
+
+static struct lock_site_stats lock_sites[LOCK_SITE_COUNT];
+
+#define lock_stat_add(field, n) __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+// Returns how long the caller waited for the lock, 0 if it was free.
+uint64_t scores_lock(int site)
+{
+	struct lock_site_stats *stats = &lock_sites[site];
+	uint64_t wait = 0;
+	if (pthread_mutex_trylock(&scores_mutex) != 0) {
+		uint64_t started = latency_now();
+		pthread_mutex_lock(&scores_mutex);
+		wait = latency_now() - started;
+		if (lock_profiling) {
+			lock_stat_add(stats->contended, 1);
+			lock_stat_add(stats->wait_ns, wait);
+		}
+	}
+	if (lock_profiling) {
+		lock_stat_add(stats->acquisitions, 1);
+		stats->locked_at = latency_now();
+	}
+	return wait;
+}
+
+void scores_unlock(int site)
+{
+	struct lock_site_stats *stats = &lock_sites[site];
+	if (lock_profiling) {
+		uint64_t held = latency_now() - stats->locked_at;
+		lock_stat_add(stats->hold_ns, held);
+		if (held > stats->max_hold_ns) {
+			__atomic_store_n(&stats->max_hold_ns, held, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&scores_mutex);
+}
+
+// Appends one INFO line per call site.
+int lock_profile_info(char *out, size_t size)
+{
+	int i, n = 0;
+	for (i = 0; i < LOCK_SITE_COUNT; i++) {
+		struct lock_site_stats *stats = &lock_sites[i];
+		n += snprintf(out + n, size - n,
+			"lock_%s:acquisitions=%" PRIu64 ",contended=%" PRIu64 ",wait_usec=%" PRIu64 ",hold_usec=%" PRIu64 ",max_hold_usec=%" PRIu64 "\r\n",
+			lock_site_names[i],
+			__atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->contended, __ATOMIC_RELAXED),
+			__atomic_load_n(&stats->wait_ns, __ATOMIC_RELAXED) / 1000,
+			__atomic_load_n(&stats->hold_ns, __ATOMIC_RELAXED) / 1000,
+			__atomic_load_n(&stats->max_hold_ns, __ATOMIC_RELAXED) / 1000);
+	}
+	return n;
+}
+
+const char *lock_site_name(int site)
+{
+	return lock_site_names[site];
+}
+
+// Fields must be read with relaxed atomic loads.
+struct lock_site_stats *lock_site_get(int site)
+{
+	return &lock_sites[site];
+}
@@ -0,0 +1,59 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __LOCKPROF_H__
+#define __LOCKPROF_H__
+
+#include <stdint.h>
+
+// Places that take scores_mutex, profiled separately.
+enum lock_site {
+	LOCK_SITE_UPDATE = 0,
+	LOCK_SITE_NEXT,
+	LOCK_SITE_COALESCE,
+	LOCK_SITE_ENGINE,
+	LOCK_SITE_SNAPSHOT,
+	LOCK_SITE_RELOAD,
+	LOCK_SITE_COUNT
+};
+
+// Only written while holding scores_mutex, read by INFO without it.
+struct lock_site_stats {
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t wait_ns;
+	uint64_t hold_ns;
+	uint64_t max_hold_ns;
+	uint64_t locked_at;
+} __attribute__((aligned(64)));
+
+// Set by --lock-profiling.
+int lock_profiling;
+
+uint64_t scores_lock(int site);
+void scores_unlock(int site);
+int lock_profile_info(char *out, size_t size);
+const char *lock_site_name(int site);
+struct lock_site_stats *lock_site_get(int site);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <err.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <event.h>
+#include <evhttp.h>
+
+#include "barbershop.h"
+#include "coalesce.h"
+#include "commands.h"
+#include "engine.h"
+#include "latency.h"
+#include "lockprof.h"
+#include "metrics.h"
+#include "stats.h"
+
+// Bucket bounds for the exported histograms, the internal ones are far too
+// fine grained to scrape.
+#define METRICS_BUCKETS 16
+
+static const uint64_t bucket_ns[METRICS_BUCKETS] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 100000000, 1000000000
+};
+
+static const char *bucket_le[METRICS_BUCKETS] = {
+	"1e-06", "2.5e-06", "5e-06", "1e-05", "2.5e-05", "5e-05", "0.0001", "0.00025", "0.0005",
+	"0.001", "0.0025", "0.005", "0.01", "0.025", "0.1", "1.0"
+};
+
+static void metric_family(struct evbuffer *out, const char *name, const char *type, const char *help) {
+	evbuffer_add_printf(out, "# TYPE barbershop_%s %s\n# HELP barbershop_%s %s\n", name, type, name, help);
+}
+
+static void metric_counter(struct evbuffer *out, const char *name, const char *help, uint64_t value) {
+	metric_family(out, name, "counter", help);
+	evbuffer_add_printf(out, "barbershop_%s_total %" PRIu64 "\n", name, value);
+}
+
+static void metric_gauge(struct evbuffer *out, const char *name, const char *help, uint64_t value) {
+	metric_family(out, name, "gauge", help);
+	evbuffer_add_printf(out, "barbershop_%s %" PRIu64 "\n", name, value);
+}
+
+static void lowercase(char *out, size_t size, const char *name) {
+	size_t i;
+	for (i = 0; name[i] != '\0' && i < size - 1; i++) {
+		out[i] = name[i] | 0x20;
+	}
+	out[i] = '\0';
+}
+
+static void metric_histogram(struct evbuffer *out, const char *name, const char *command, struct latency_histogram *histogram) {
+	uint64_t counts[METRICS_BUCKETS];
+	uint64_t total = latency_cumulative(histogram, bucket_ns, METRICS_BUCKETS, counts);
+	char label[16];
+	int i;
+	lowercase(label, sizeof(label), command);
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		evbuffer_add_printf(out, "barbershop_%s_bucket{command=\"%s\",le=\"%s\"} %" PRIu64 "\n",
+			name, label, bucket_le[i], counts[i]);
+	}
+	evbuffer_add_printf(out, "barbershop_%s_bucket{command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n", name, label, total);
+	evbuffer_add_printf(out, "barbershop_%s_count{command=\"%s\"} %" PRIu64 "\n", name, label, total);
+	evbuffer_add_printf(out, "barbershop_%s_sum{command=\"%s\"} %.9f\n", name, label,
+		__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / 1e9);
+}
+
+static void metric_lock_sites(struct evbuffer *out, const char *name, const char *help, size_t offset, double scale) {
+	int i;
+	metric_family(out, name, "counter", help);
+	for (i = 0; i < LOCK_SITE_COUNT; i++) {
+		uint64_t *field = (uint64_t *)((char *)lock_site_get(i) + offset);
+		uint64_t value = __atomic_load_n(field, __ATOMIC_RELAXED);
+		if (scale == 1) {
+			evbuffer_add_printf(out, "barbershop_%s_total{site=\"%s\"} %" PRIu64 "\n", name, lock_site_name(i), value);
+		} else {
+			evbuffer_add_printf(out, "barbershop_%s_total{site=\"%s\"} %.9f\n", name, lock_site_name(i), value * scale);
+		}
+	}
+}
+
+// Everything here is read from per-thread counters and relaxed atomics, a
+// scrape never takes scores_mutex.
+static void on_metrics(struct evhttp_request *req, void *arg) {
+	struct evbuffer *out = evbuffer_new();
+	time_t current_time;
+	int i;
+	if (out == NULL) {
+		evhttp_send_error(req, HTTP_SERVUNAVAIL, "Out of memory");
+		return;
+	}
+	time(&current_time);
+	metric_family(out, "build", "info", "Server version.");
+	evbuffer_add_printf(out, "barbershop_build_info{version=\"%s\"} 1\n", app_stats.version);
+	metric_gauge(out, "uptime_seconds", "Seconds since the server started.", current_time - app_stats.started_at);
+	metric_gauge(out, "items", "Items in the queue.", stats_get(items));
+	metric_gauge(out, "pools", "Distinct scores in the queue.", stats_get(pools));
+	metric_gauge(out, "connected_clients", "Open client connections.", stats_get(connected_clients));
+	metric_gauge(out, "blocked_clients", "Clients waiting in BNEXT.", blocked_client_count());
+	metric_counter(out, "updates", "Score updates applied.", stats_get(updates));
+	metric_counter(out, "commands_processed", "Commands processed.", stats_get(commands));
+	metric_counter(out, "error_replies", "Error replies sent.", stats_get(error_replies));
+	metric_counter(out, "connections_received", "Connections accepted.", stats_get(connections));
+	metric_counter(out, "rejected_clients", "Connections refused over max-clients.", stats_get(rejected_clients));
+	metric_counter(out, "net_input_bytes", "Bytes read from clients.", stats_get(bytes_in));
+	metric_counter(out, "net_output_bytes", "Bytes written to clients.", stats_get(bytes_out));
+	metric_counter(out, "udp_datagrams", "UDP datagrams received.", stats_get(udp_datagrams));
+	metric_counter(out, "udp_updates", "Updates received over UDP.", stats_get(udp_updates));
+	metric_counter(out, "udp_errors", "Malformed UDP datagrams.", stats_get(udp_errors));
+	metric_counter(out, "udp_drops", "UDP datagrams dropped.", stats_get(udp_drops) + app_stats.udp_kernel_drops);
+	if (coalesce_interval > 0) {
+		metric_counter(out, "coalesce_received", "Updates received by the coalescer.", stats_get(coalesce_received));
+		metric_counter(out, "coalesce_applied", "Updates applied by the coalescer.", stats_get(coalesce_applied));
+		metric_gauge(out, "coalesce_pending", "Items waiting for the next coalescer flush.", coalesce_pending());
+	}
+	if (engine_enabled) {
+		metric_counter(out, "engine_ops", "Operations run by the engine thread.", stats_get(engine_ops));
+		metric_counter(out, "engine_batches", "Batches run by the engine thread.", stats_get(engine_batches));
+		metric_gauge(out, "engine_in_flight", "Operations queued for the engine thread.", app_stats.engine_in_flight);
+	}
+	metric_family(out, "command_duration_seconds", "histogram", "Time from reading a request to queueing its reply.");
+	for (i = 0; i < COMMAND_COUNT; i++) {
+		if (command_name(i) != NULL) {
+			metric_histogram(out, "command_duration_seconds", command_name(i), command_latency_histogram(i));
+		}
+	}
+	metric_family(out, "lock_wait_seconds", "histogram", "Time spent waiting for scores_mutex.");
+	for (i = 0; i < COMMAND_COUNT; i++) {
+		if (command_name(i) != NULL) {
+			metric_histogram(out, "lock_wait_seconds", command_name(i), command_lock_histogram(i));
+		}
+	}
+	metric_histogram(out, "lock_wait_seconds", "ENGINE", &engine_lock_latency);
+	if (lock_profiling) {
+		metric_lock_sites(out, "lock_site_acquisitions", "scores_mutex acquisitions.",
+			offsetof(struct lock_site_stats, acquisitions), 1);
+		metric_lock_sites(out, "lock_site_contended", "scores_mutex acquisitions that had to wait.",
+			offsetof(struct lock_site_stats, contended), 1);
+		metric_lock_sites(out, "lock_site_wait_seconds", "Time spent waiting for scores_mutex.",
+			offsetof(struct lock_site_stats, wait_ns), 1e-9);
+		metric_lock_sites(out, "lock_site_hold_seconds", "Time scores_mutex was held.",
+			offsetof(struct lock_site_stats, hold_ns), 1e-9);
+	}
+	evbuffer_add_printf(out, "# EOF\n");
+	evhttp_add_header(req->output_headers, "Content-Type", "application/openmetrics-text; version=1.0.0; charset=utf-8");
+	evhttp_send_reply(req, HTTP_OK, "OK", out);
+	evbuffer_free(out);
+}
+
+// Serves /metrics on the main event base, must be called after event_init.
+void metrics_init(int port) {
+	struct evhttp *http = evhttp_start("0.0.0.0", port);
+	if (http == NULL) {
+		errx(1, "could not listen for metrics on port %d", port);
+	}
+	evhttp_set_cb(http, "/metrics", on_metrics, NULL);
+}
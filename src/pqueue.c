@@ -20,26 +20,192 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include "latency.h"
 #include "pqueue.h"
 #include "stats.h"
 
+/*
+ * Writers (update, getNext) are serialized by the caller. Readers do not
+ * lock: peekNext reads the published top of the queue and getScore walks
+ * the item tree under a seqlock, retrying when a writer got in the way.
+ * Nodes are recycled through per type free lists and never returned to
+ * the allocator, so a reader racing with a writer only ever follows
+ * pointers to nodes of the type it expects.
+ */
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define NODE_CHUNK 1024
+#define READ_CHECK_STEPS 64
+// Loads use up to MAX_BUILD_THREADS threads, with at least BUILD_MIN_ITEMS
+// items each.
+#define MAX_BUILD_THREADS 64
+#define BUILD_MIN_ITEMS 65536
+#define RADIX_BITS 11
+
+static unsigned long sequence = 0;
+static int publishedTop = -1;
+static int topScore = 0;
+static uint64_t publishedTopSince = 0;
+static uint64_t poolSizes[POOL_SIZE_BUCKETS];
+// Items by score, in the same log-linear buckets as latency histograms.
+static uint64_t scoreItems[LATENCY_BUCKETS];
+// Time from entering the queue to being taken by NEXT.
+static struct latency_histogram waitTimes;
+static void *freeItemNodes = NULL;
+static void *freeItemTreeNodes = NULL;
+static void *freeScoreTreeNodes = NULL;
+
+static int updateItem(int itemId, int score);
+static int removeNext(int dequeued);
+
+static void beginWrite()
+{
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void endWrite()
+{
+	__atomic_store_n(&sequence, sequence + 1, __ATOMIC_RELEASE);
+}
+
+static unsigned long beginRead()
+{
+	unsigned long seq;
+	while((seq = __atomic_load_n(&sequence, __ATOMIC_ACQUIRE)) & 1)
+		;
+	return seq;
+}
+
+static int retryRead(unsigned long seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return READ_ONCE(sequence) != seq;
+}
+
+static void publishTop(ScoreTreeNode snode)
+{
+	__atomic_store_n(&topScore, snode == NULL ? 0 : snode->score, __ATOMIC_RELAXED);
+	__atomic_store_n(&publishedTopSince, snode == NULL ? 0 : snode->head->enqueuedAt, __ATOMIC_RELAXED);
+	__atomic_store_n(&publishedTop, snode == NULL ? -1 : snode->head->itemId, __ATOMIC_RELEASE);
+}
+
+static void countAdd(uint64_t *counter, int n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Moves a pool to the size bucket for its new item count and counts the
+// items entering or leaving its score.
+static void resizePool(ScoreTreeNode snode, int delta)
+{
+	if(snode->count > 0)
+		countAdd(&poolSizes[31 - __builtin_clz(snode->count)], -1);
+	snode->count += delta;
+	if(snode->count > 0)
+		countAdd(&poolSizes[31 - __builtin_clz(snode->count)], 1);
+	countAdd(&scoreItems[latency_bucket(snode->score > 0 ? snode->score : 0)], delta);
+}
+
+// Fresh chunks are zeroed so a reader never sees an uninitialized pointer.
+static void *allocNode(void **freeList, size_t size)
+{
+	char *chunk;
+	int i;
+	void *node = *freeList;
+	if(node != NULL)
+	{
+		*freeList = *(void **)node;
+		return node;
+	}
+	if(!(chunk = calloc(NODE_CHUNK, size)))
+		return NULL;
+	for(i = NODE_CHUNK - 1; i > 0; i--)
+	{
+		*(void **)(chunk + i * size) = *freeList;
+		*freeList = chunk + i * size;
+	}
+	return chunk;
+}
+
+static void freeNode(void **freeList, void *node)
+{
+	*(void **)node = *freeList;
+	*freeList = node;
+}
+
 void initializePriorityQueue()
 {
 	score_root = NULL;
 	item_root = NULL;
+	publishTop(NULL);
 }
 
 int peekNext()
 {
-	ScoreTreeNode snode = findMaxScore(score_root);
-	if(snode == NULL)
+	return __atomic_load_n(&publishedTop, __ATOMIC_ACQUIRE);
+}
+
+void getPoolSizes(uint64_t *counts)
+{
+	int i;
+	for(i = 0; i < POOL_SIZE_BUCKETS; i++)
+		counts[i] = READ_ONCE(poolSizes[i]);
+}
+
+// Capped at the top score, so it is exact for the highest scores.
+int getScorePercentile(double percentile)
+{
+	uint64_t total = 0, seen = 0, target, value;
+	int i, top = READ_ONCE(topScore);
+	for(i = 0; i < LATENCY_BUCKETS; i++)
+		total += READ_ONCE(scoreItems[i]);
+	if(total == 0 || top <= 0)
+		return top;
+	target = latency_rank(total, percentile);
+	for(i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += READ_ONCE(scoreItems[i]);
+		if(seen >= target)
+		{
+			value = latency_bucket_value(i);
+			return value > (uint64_t)top ? top : (int)value;
+		}
+	}
+	return top;
+}
+
+struct latency_histogram *getWaitTimes()
+{
+	return &waitTimes;
+}
+
+// Nanoseconds since the item NEXT would return entered the queue, -1 when
+// it is empty. Of the items in the top pool it is the one that reached
+// that score first.
+int64_t getTopAge()
+{
+	uint64_t since = READ_ONCE(publishedTopSince);
+	if(since == 0)
 		return -1;
-	return snode->head->itemId;
+	return latency_now() - since;
 }
 
 int getNext()
+{
+	beginWrite();
+	int rval = removeNext(1);
+	publishTop(findMaxScore(score_root));
+	endWrite();
+	return rval;
+}
+
+// dequeued is 0 when the queue is being emptied rather than served, so the
+// item's wait is not recorded.
+static int removeNext(int dequeued)
 {
 	ScoreTreeNode snode = findMaxScore(score_root);
 	if(snode == NULL)
@@ -54,6 +220,8 @@ int getNext()
 	}
 	itnode->score = 0;
 	ItemNode tmp = itnode->item;
+	if(dequeued)
+		latency_record(&waitTimes, latency_now() - tmp->enqueuedAt);
 	item_root = deleteItemTreeNode(item_root, itnode);
 	deleteItemNode(tmp);
 
@@ -62,21 +230,89 @@ int getNext()
 
 void emptyPriorityQueue()
 {
-	int r = getNext();
-	while(r > -1)
-		r = getNext();
+	int r;
+	do
+	{
+		beginWrite();
+		r = removeNext(0);
+		publishTop(findMaxScore(score_root));
+		endWrite();
+	} while(r > -1);
 }
 
+// Safe to call without holding the writers' lock. The walk is abandoned
+// early if a writer changed the tree under it, since it may have been led
+// into a cycle.
 int getScore(int itemId)
 {
-	ItemTreeNode itnode = findItem(itemId, item_root);
-	if(itnode == NULL)
-		return -1;
-	return itnode->score;
+	unsigned long seq;
+	int steps, id, score;
+	ItemTreeNode tree;
+	ItemNode item;
+	while(1)
+	{
+		seq = beginRead();
+		score = -1;
+		tree = READ_ONCE(item_root);
+		for(steps = 1; tree != NULL; steps++)
+		{
+			item = READ_ONCE(tree->item);
+			if(item == NULL || (steps % READ_CHECK_STEPS == 0 && retryRead(seq)))
+				break;
+			id = READ_ONCE(item->itemId);
+			if(itemId < id)
+			{
+				tree = READ_ONCE(tree->left);
+			}
+			else if(itemId > id)
+			{
+				tree = READ_ONCE(tree->right);
+			}
+			else
+			{
+				score = READ_ONCE(tree->score);
+				break;
+			}
+		}
+		if(!retryRead(seq))
+			return score;
+	}
 }
 
 // returns 1 on adding item, 0 on successful update of item, -1 on error
 int update(int itemId, int score)
+{
+	beginWrite();
+	int rval = updateItem(itemId, score);
+	endWrite();
+	return rval;
+}
+
+int removeItem(int itemId)
+{
+	beginWrite();
+	ItemTreeNode itnode = findItem(itemId, item_root);
+	if(itnode == NULL)
+	{
+		endWrite();
+		return 0;
+	}
+	ScoreTreeNode snode = findScore(itnode->score, score_root);
+	int populated = removeItemNode(snode, itnode->item);
+	if(!populated)
+	{
+		score_root = deleteScoreTreeNode(score_root, snode);
+	}
+	itnode->score = 0;
+	ItemNode tmp = itnode->item;
+	item_root = deleteItemTreeNode(item_root, itnode);
+	deleteItemNode(tmp);
+	publishTop(findMaxScore(score_root));
+	endWrite();
+	return 1;
+}
+
+static int updateItem(int itemId, int score)
 {
 	int rval = 0;
 	int newscore = score;
@@ -117,7 +353,11 @@ int update(int itemId, int score)
 	}
 	addItemNode(snode, itnode->item);
 	itnode->score = snode->score;
-	app_stats.updates += 1;
+	// Scores only grow, so the top changes only if this pool is now the
+	// highest.
+	if(newscore >= topScore)
+		publishTop(findMaxScore(snode));
+	stats_add(updates, 1);
 	return rval;
 }
 
@@ -141,6 +381,690 @@ void outputScoresIterator(FILE *fd, ScoreTreeNode tree)
 }
 
 
+int iterateByPriority(void (*callback)(int itemId, int score, void *arg), void *arg)
+{
+	ScoreTreeNode *stack = NULL, *grown, node = score_root;
+	size_t depth = 0, size = 0;
+	ItemNode i;
+	// Reverse in-order walk with an explicit stack, pools added with rising
+	// scores leave the tree far too deep to recurse.
+	while(node != NULL || depth > 0)
+	{
+		while(node != NULL)
+		{
+			if(depth == size)
+			{
+				size = size == 0 ? 64 : size * 2;
+				if(!(grown = realloc(stack, size * sizeof(*stack))))
+				{
+					free(stack);
+					return -1;
+				}
+				stack = grown;
+			}
+			stack[depth++] = node;
+			node = node->right;
+		}
+		node = stack[--depth];
+		for(i = node->head; i != NULL; i = i->next)
+			callback(i->itemId, node->score, arg);
+		node = node->left;
+	}
+	free(stack);
+	return 0;
+}
+
+struct load_entry {
+	int itemId;
+	int score;
+	size_t index;
+};
+
+static int compareLoadEntries(const void *a, const void *b)
+{
+	const struct load_entry *x = a, *y = b;
+	if(x->itemId != y->itemId)
+		return x->itemId < y->itemId ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Highest score first, then in the order the items reached their pool.
+static int compareQueueEntries(const void *a, const void *b)
+{
+	const struct load_entry *x = a, *y = b;
+	if(x->score != y->score)
+		return x->score > y->score ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// nodes must be sorted, the middle one becomes the root.
+static ScoreTreeNode buildScoreTree(ScoreTreeNode *nodes, size_t count)
+{
+	if(count == 0)
+		return NULL;
+	size_t middle = count / 2;
+	nodes[middle]->left = buildScoreTree(nodes, middle);
+	nodes[middle]->right = buildScoreTree(nodes + middle + 1, count - middle - 1);
+	return nodes[middle];
+}
+
+static ItemTreeNode buildItemTree(ItemTreeNode *nodes, size_t count)
+{
+	if(count == 0)
+		return NULL;
+	size_t middle = count / 2;
+	nodes[middle]->left = buildItemTree(nodes, middle);
+	nodes[middle]->right = buildItemTree(nodes + middle + 1, count - middle - 1);
+	return nodes[middle];
+}
+
+static void pushNode(struct node_list *list, void *node)
+{
+	if(list->head == NULL)
+		list->tail = node;
+	*(void **)node = list->head;
+	list->head = node;
+}
+
+// Moves the nodes of from to the front of to.
+static void spliceList(struct node_list *to, struct node_list *from)
+{
+	if(from->head == NULL)
+		return;
+	if(to->head == NULL)
+		to->tail = from->tail;
+	*(void **)from->tail = to->head;
+	to->head = from->head;
+	from->head = NULL;
+	from->tail = NULL;
+}
+
+// As allocNode, for a queue being built.
+static void *allocImageNode(struct node_list *list, size_t size)
+{
+	char *chunk;
+	int i;
+	void *node = list->head;
+	if(node != NULL)
+	{
+		list->head = *(void **)node;
+		if(list->head == NULL)
+			list->tail = NULL;
+		return node;
+	}
+	if(!(chunk = calloc(NODE_CHUNK, size)))
+		return NULL;
+	for(i = NODE_CHUNK - 1; i > 0; i--)
+		pushNode(list, chunk + i * size);
+	return chunk;
+}
+
+// One range of a load, handled by a thread of its own.
+struct build_task
+{
+	const int *pairs;
+	size_t begin;
+	size_t end;
+	int failed;
+	// Sorting: entries to sort, or the runs to merge from one array into
+	// the other.
+	struct load_entry *from;
+	struct load_entry *to;
+	size_t middle;
+	int (*compare)(const void *, const void *);
+	// Building: the pools starting in the range and where their nodes
+	// go, highest first, the nodes built and where they came from. Items
+	// before the first pool starting in the range belong to the last pool
+	// of an earlier range and are left as a fragment to append to it.
+	size_t npools;
+	ScoreTreeNode *poolSlot;
+	ItemTreeNode *itemNodes;
+	ItemTreeNode *sortedNodes;
+	ScoreTreeNode lastPool;
+	ItemNode fragmentHead;
+	ItemNode fragmentTail;
+	int fragmentCount;
+	struct node_list itemList;
+	struct node_list itemTreeList;
+	struct node_list scoreTreeList;
+	uint64_t now;
+};
+
+// Runs fn on each task, the first one on the calling thread and the
+// others on threads of their own, or on the calling thread if one can
+// not be started.
+static void runTasks(void *(*fn)(void *), struct build_task *tasks, int count)
+{
+	pthread_t threads[MAX_BUILD_THREADS];
+	int started[MAX_BUILD_THREADS], i;
+	for(i = 1; i < count; i++)
+		started[i] = pthread_create(&threads[i], NULL, fn, &tasks[i]) == 0;
+	fn(&tasks[0]);
+	for(i = 1; i < count; i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fn(&tasks[i]);
+	}
+}
+
+// Splits count items into ranges of at least BUILD_MIN_ITEMS for up to
+// threads threads. Returns the number of ranges.
+static int splitRanges(struct build_task *tasks, size_t count, int threads)
+{
+	int i, n = threads < 1 ? 1 : threads > MAX_BUILD_THREADS ? MAX_BUILD_THREADS : threads;
+	if((size_t)n > count / BUILD_MIN_ITEMS)
+		n = count / BUILD_MIN_ITEMS > 0 ? count / BUILD_MIN_ITEMS : 1;
+	memset(tasks, 0, n * sizeof(*tasks));
+	for(i = 0; i < n; i++)
+	{
+		tasks[i].begin = count * i / n;
+		tasks[i].end = count * (i + 1) / n;
+	}
+	return n;
+}
+
+// Least significant digit first, RADIX_BITS at a time, so items that
+// repeat keep the order they came in.
+static int radixSortRange(struct load_entry *entries, size_t count)
+{
+	size_t counts[1 << RADIX_BITS], i, sum, next;
+	struct load_entry *from = entries, *to, *buffer, *swap;
+	unsigned int shift, digit;
+	if(!(buffer = malloc(count * sizeof(*buffer))))
+		return -1;
+	to = buffer;
+	for(shift = 0; shift < 32; shift += RADIX_BITS)
+	{
+		memset(counts, 0, sizeof(counts));
+		for(i = 0; i < count; i++)
+			counts[(((uint32_t)from[i].itemId ^ 0x80000000u) >> shift) & ((1 << RADIX_BITS) - 1)]++;
+		for(i = 0, sum = 0; i < (1 << RADIX_BITS); i++)
+		{
+			next = sum + counts[i];
+			counts[i] = sum;
+			sum = next;
+		}
+		for(i = 0; i < count; i++)
+		{
+			digit = (((uint32_t)from[i].itemId ^ 0x80000000u) >> shift) & ((1 << RADIX_BITS) - 1);
+			to[counts[digit]++] = from[i];
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if(from != entries)
+		memcpy(entries, from, count * sizeof(*entries));
+	free(buffer);
+	return 0;
+}
+
+// Entries to sort by item always come in index order, which the radix
+// sort keeps for an item repeated by UPDATEs.
+static void *sortRange(void *arg)
+{
+	struct build_task *task = arg;
+	if(task->compare != compareLoadEntries || radixSortRange(task->from + task->begin, task->end - task->begin) < 0)
+		qsort(task->from + task->begin, task->end - task->begin, sizeof(*task->from), task->compare);
+	return NULL;
+}
+
+static void *mergeRuns(void *arg)
+{
+	struct build_task *task = arg;
+	size_t i = task->begin, j = task->middle, k = task->begin;
+	while(i < task->middle && j < task->end)
+	{
+		if(task->compare(&task->from[j], &task->from[i]) < 0)
+			task->to[k++] = task->from[j++];
+		else
+			task->to[k++] = task->from[i++];
+	}
+	while(i < task->middle)
+		task->to[k++] = task->from[i++];
+	while(j < task->end)
+		task->to[k++] = task->from[j++];
+	return NULL;
+}
+
+// Sorts the ranges in parallel, then merges them in pairs, each round's
+// merges in parallel. Returns -1 if memory runs out.
+static int sortEntries(struct load_entry *entries, size_t count, int (*compare)(const void *, const void *), int threads)
+{
+	struct build_task tasks[MAX_BUILD_THREADS], merges[MAX_BUILD_THREADS];
+	size_t bounds[MAX_BUILD_THREADS + 1];
+	struct load_entry *from = entries, *to, *swap;
+	int n = splitRanges(tasks, count, threads), i, runs;
+	for(i = 0; i < n; i++)
+	{
+		tasks[i].from = entries;
+		tasks[i].compare = compare;
+		bounds[i] = tasks[i].begin;
+	}
+	bounds[n] = count;
+	runTasks(sortRange, tasks, n);
+	if(n == 1)
+		return 0;
+	if(!(to = malloc(count * sizeof(*to))))
+		return -1;
+	for(runs = n; runs > 1; runs = (runs + 1) / 2)
+	{
+		memset(merges, 0, sizeof(merges));
+		for(i = 0; i < runs / 2; i++)
+		{
+			merges[i].from = from;
+			merges[i].to = to;
+			merges[i].compare = compare;
+			merges[i].begin = bounds[2 * i];
+			merges[i].middle = bounds[2 * i + 1];
+			merges[i].end = bounds[2 * i + 2];
+		}
+		// An odd run out is carried over as it is.
+		if(runs % 2)
+			memcpy(to + bounds[runs - 1], from + bounds[runs - 1], (bounds[runs] - bounds[runs - 1]) * sizeof(*to));
+		runTasks(mergeRuns, merges, runs / 2);
+		for(i = 0; i <= runs / 2; i++)
+			bounds[i] = bounds[2 * i < runs ? 2 * i : runs];
+		bounds[(runs + 1) / 2] = count;
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	if(from != entries)
+	{
+		memcpy(entries, from, count * sizeof(*entries));
+		free(from);
+	}
+	else
+		free(to);
+	return 0;
+}
+
+// Works out the queue UPDATEs of pairs would leave: a positive score is
+// added to, anything else replaced, and every update moves the item to
+// the end of its pool.
+static int orderUpdates(const int *pairs, size_t count, int threads, int **ordered, size_t *n)
+{
+	struct load_entry *entries = malloc(count * sizeof(*entries));
+	size_t i, j = 0;
+	*ordered = NULL;
+	*n = 0;
+	if(count == 0)
+	{
+		free(entries);
+		return 0;
+	}
+	if(entries == NULL)
+		return -1;
+	for(i = 0; i < count; i++)
+	{
+		entries[i].itemId = pairs[2 * i];
+		entries[i].score = pairs[2 * i + 1];
+		entries[i].index = i;
+	}
+	if(sortEntries(entries, count, compareLoadEntries, threads) < 0)
+	{
+		free(entries);
+		return -1;
+	}
+	for(i = 0; i < count; i++)
+	{
+		if(j > 0 && entries[j - 1].itemId == entries[i].itemId)
+		{
+			if(entries[j - 1].score > 0)
+				entries[j - 1].score += entries[i].score;
+			else
+				entries[j - 1].score = entries[i].score;
+			entries[j - 1].index = entries[i].index;
+		}
+		else
+			entries[j++] = entries[i];
+	}
+	if(sortEntries(entries, j, compareQueueEntries, threads) < 0 ||
+		!(*ordered = malloc(2 * j * sizeof(**ordered))))
+	{
+		free(entries);
+		return -1;
+	}
+	for(i = 0; i < j; i++)
+	{
+		(*ordered)[2 * i] = entries[i].itemId;
+		(*ordered)[2 * i + 1] = entries[i].score;
+	}
+	*n = j;
+	free(entries);
+	return 0;
+}
+
+// Checks the range is in order and counts the pools starting in it.
+static void *scanRange(void *arg)
+{
+	struct build_task *task = arg;
+	const int *pairs = task->pairs;
+	size_t i;
+	for(i = task->begin; i < task->end; i++)
+	{
+		if(i > 0 && pairs[2 * i + 1] > pairs[2 * i - 1])
+			task->failed = 1;
+		if(i == 0 || pairs[2 * i + 1] != pairs[2 * i - 1])
+			task->npools++;
+	}
+	return NULL;
+}
+
+static void *buildRange(void *arg)
+{
+	struct build_task *task = arg;
+	const int *pairs = task->pairs;
+	ScoreTreeNode snode = NULL, *slot = task->poolSlot;
+	ItemTreeNode itnode;
+	ItemNode item;
+	size_t i;
+	for(i = task->begin; i < task->end; i++)
+	{
+		if(i == 0 || pairs[2 * i + 1] != pairs[2 * i - 1])
+		{
+			if(!(snode = allocImageNode(&task->scoreTreeList, sizeof(struct score_tree_node))))
+				break;
+			snode->score = pairs[2 * i + 1];
+			snode->count = 0;
+			snode->head = NULL;
+			snode->tail = NULL;
+			*slot-- = snode;
+		}
+		if(!(itnode = allocImageNode(&task->itemTreeList, sizeof(struct item_tree_node))))
+			break;
+		if(!(item = allocImageNode(&task->itemList, sizeof(struct item_node))))
+		{
+			pushNode(&task->itemTreeList, itnode);
+			break;
+		}
+		item->itemId = pairs[2 * i];
+		item->next = NULL;
+		item->enqueuedAt = task->now;
+		if(snode == NULL)
+		{
+			item->prev = task->fragmentTail;
+			if(task->fragmentHead == NULL)
+				task->fragmentHead = item;
+			else
+				task->fragmentTail->next = item;
+			task->fragmentTail = item;
+			task->fragmentCount++;
+		}
+		else
+		{
+			item->prev = snode->tail;
+			if(snode->head == NULL)
+				snode->head = item;
+			else
+				snode->tail->next = item;
+			snode->tail = item;
+			snode->count++;
+		}
+		itnode->item = item;
+		itnode->score = pairs[2 * i + 1];
+		task->itemNodes[i] = itnode;
+	}
+	task->failed = i < task->end;
+	task->lastPool = snode;
+	return NULL;
+}
+
+// Puts the item tree nodes of the range of sorted entries in item order.
+static void *gatherRange(void *arg)
+{
+	struct build_task *task = arg;
+	size_t i;
+	for(i = task->begin; i < task->end; i++)
+		task->sortedNodes[i] = task->itemNodes[task->from[i].index];
+	return NULL;
+}
+
+// Hands the nodes built by a failed load back to the image's free lists.
+static void discardRange(struct build_task *task)
+{
+	size_t i;
+	for(i = task->begin; i < task->end && task->itemNodes[i] != NULL; i++)
+	{
+		pushNode(&task->itemList, task->itemNodes[i]->item);
+		pushNode(&task->itemTreeList, task->itemNodes[i]);
+	}
+	for(i = 0; i < task->npools && task->poolSlot[-(long)i] != NULL; i++)
+		pushNode(&task->scoreTreeList, task->poolSlot[-(long)i]);
+}
+
+// Ranges of the pairs are checked, sorted by item and turned into nodes
+// in parallel. A pool spanning ranges is started by the range holding its
+// first item and the items of the others appended to it afterwards.
+static int buildImage(const int *pairs, size_t count, int threads, struct queue_image *image)
+{
+	struct build_task tasks[MAX_BUILD_THREADS];
+	struct load_entry *entries = NULL;
+	ItemTreeNode *itemNodes = NULL, *sortedNodes = NULL;
+	ScoreTreeNode *scoreNodes = NULL, current = NULL, snode;
+	size_t i, npools = 0;
+	uint64_t now = latency_now();
+	int n = splitRanges(tasks, count, threads), k, rval = 0, failed = 0;
+	for(k = 0; k < n; k++)
+		tasks[k].pairs = pairs;
+	runTasks(scanRange, tasks, n);
+	for(k = 0; k < n; k++)
+	{
+		if(tasks[k].failed)
+			return -1;
+		npools += tasks[k].npools;
+	}
+	entries = malloc(count * sizeof(*entries));
+	itemNodes = calloc(count, sizeof(*itemNodes));
+	sortedNodes = malloc(count * sizeof(*sortedNodes));
+	scoreNodes = calloc(npools, sizeof(*scoreNodes));
+	if((count > 0 && (entries == NULL || itemNodes == NULL || sortedNodes == NULL)) ||
+		(npools > 0 && scoreNodes == NULL))
+	{
+		rval = -1;
+		goto done;
+	}
+	for(i = 0; i < count; i++)
+	{
+		entries[i].itemId = pairs[2 * i];
+		entries[i].index = i;
+	}
+	if(sortEntries(entries, count, compareLoadEntries, threads) < 0)
+	{
+		rval = -1;
+		goto done;
+	}
+	for(i = 1; i < count; i++)
+	{
+		if(entries[i].itemId == entries[i - 1].itemId)
+		{
+			rval = -1;
+			goto done;
+		}
+	}
+
+	// Pools come highest first, so they are stored from the end to leave
+	// the array in ascending order.
+	for(k = 0, i = npools; k < n; k++)
+	{
+		tasks[k].poolSlot = scoreNodes + i - 1;
+		tasks[k].itemNodes = itemNodes;
+		tasks[k].now = now;
+		i -= tasks[k].npools;
+	}
+	runTasks(buildRange, tasks, n);
+	for(k = 0; k < n; k++)
+		failed |= tasks[k].failed;
+	for(k = 0; k < n; k++)
+	{
+		if(failed)
+			discardRange(&tasks[k]);
+		else if(tasks[k].fragmentCount > 0)
+		{
+			current->tail->next = tasks[k].fragmentHead;
+			tasks[k].fragmentHead->prev = current->tail;
+			current->tail = tasks[k].fragmentTail;
+			current->count += tasks[k].fragmentCount;
+		}
+		if(tasks[k].lastPool != NULL)
+			current = tasks[k].lastPool;
+		spliceList(&image->itemNodes, &tasks[k].itemList);
+		spliceList(&image->itemTreeNodes, &tasks[k].itemTreeList);
+		spliceList(&image->scoreTreeNodes, &tasks[k].scoreTreeList);
+	}
+	if(failed)
+	{
+		rval = -1;
+		goto done;
+	}
+	for(i = 0; i < npools; i++)
+	{
+		snode = scoreNodes[i];
+		image->poolSizes[31 - __builtin_clz(snode->count)]++;
+		image->scoreItems[latency_bucket(snode->score > 0 ? snode->score : 0)] += snode->count;
+	}
+	image->scoreRoot = buildScoreTree(scoreNodes, npools);
+	image->pools = npools;
+	for(k = 0; k < n; k++)
+	{
+		tasks[k].from = entries;
+		tasks[k].sortedNodes = sortedNodes;
+	}
+	runTasks(gatherRange, tasks, n);
+	image->itemRoot = buildItemTree(sortedNodes, count);
+	image->items = count;
+done:
+	free(entries);
+	free(itemNodes);
+	free(sortedNodes);
+	free(scoreNodes);
+	return rval;
+}
+
+int buildQueue(const int *pairs, size_t count, int updates, int threads, struct queue_image *image)
+{
+	int *ordered, rval;
+	size_t n;
+	memset(image, 0, sizeof(*image));
+	if(!updates)
+		return buildImage(pairs, count, threads, image);
+	if(orderUpdates(pairs, count, threads, &ordered, &n) < 0)
+		return -1;
+	rval = buildImage(ordered, n, threads, image);
+	free(ordered);
+	return rval;
+}
+
+void swapQueue(struct queue_image *image)
+{
+	ScoreTreeNode scores = score_root;
+	ItemTreeNode items = item_root;
+	int64_t nitems = stats_get(items), npools = stats_get(pools);
+	uint64_t count;
+	int i;
+	beginWrite();
+	score_root = image->scoreRoot;
+	item_root = image->itemRoot;
+	for(i = 0; i < POOL_SIZE_BUCKETS; i++)
+	{
+		count = poolSizes[i];
+		__atomic_store_n(&poolSizes[i], image->poolSizes[i], __ATOMIC_RELAXED);
+		image->poolSizes[i] = count;
+	}
+	for(i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		count = scoreItems[i];
+		__atomic_store_n(&scoreItems[i], image->scoreItems[i], __ATOMIC_RELAXED);
+		image->scoreItems[i] = count;
+	}
+	stats_add(items, image->items - nitems);
+	stats_add(pools, image->pools - npools);
+	stats_add(updates, image->items);
+	publishTop(findMaxScore(score_root));
+	endWrite();
+	image->scoreRoot = scores;
+	image->itemRoot = items;
+	image->items = nitems;
+	image->pools = npools;
+}
+
+// Rotating left children up flattens the trees without a stack. A reader
+// still walking them started before the swap and is bound to retry.
+void releaseQueue(struct queue_image *image)
+{
+	ItemTreeNode itnode = image->itemRoot, nextItem;
+	ScoreTreeNode snode = image->scoreRoot, nextScore;
+	while(itnode != NULL)
+	{
+		if(itnode->left != NULL)
+		{
+			nextItem = itnode->left;
+			itnode->left = nextItem->right;
+			nextItem->right = itnode;
+		}
+		else
+		{
+			nextItem = itnode->right;
+			pushNode(&image->itemNodes, itnode->item);
+			pushNode(&image->itemTreeNodes, itnode);
+		}
+		itnode = nextItem;
+	}
+	while(snode != NULL)
+	{
+		if(snode->left != NULL)
+		{
+			nextScore = snode->left;
+			snode->left = nextScore->right;
+			nextScore->right = snode;
+		}
+		else
+		{
+			nextScore = snode->right;
+			pushNode(&image->scoreTreeNodes, snode);
+		}
+		snode = nextScore;
+	}
+	image->itemRoot = NULL;
+	image->scoreRoot = NULL;
+	image->items = 0;
+	image->pools = 0;
+}
+
+static void spliceNodes(void **freeList, struct node_list *list)
+{
+	if(list->head == NULL)
+		return;
+	*(void **)list->tail = *freeList;
+	*freeList = list->head;
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+void reclaimQueue(struct queue_image *image)
+{
+	spliceNodes(&freeItemNodes, &image->itemNodes);
+	spliceNodes(&freeItemTreeNodes, &image->itemTreeNodes);
+	spliceNodes(&freeScoreTreeNodes, &image->scoreTreeNodes);
+}
+
+int bulkLoad(const int *pairs, size_t count)
+{
+	struct queue_image image;
+	int rval;
+	if(score_root != NULL || item_root != NULL)
+		return -1;
+	rval = buildQueue(pairs, count, 0, 1, &image);
+	swapQueue(&image);
+	releaseQueue(&image);
+	reclaimQueue(&image);
+	return rval;
+}
+
+
 void dumpItems()
 {
 	dumpItemsIterator(item_root);
@@ -176,9 +1100,10 @@ void dumpScoresIterator(ScoreTreeNode tree)
 ScoreTreeNode createScoreTreeNode(int score)
 {
 	ScoreTreeNode node;
-	if(!(node = malloc(sizeof(struct score_tree_node))))
+	if(!(node = allocNode(&freeScoreTreeNodes, sizeof(struct score_tree_node))))
 		return NULL;
 	node->score = score;
+	node->count = 0;
 	node->head = NULL;
 	node->tail = NULL;
 	node->left = NULL;
@@ -188,18 +1113,19 @@ ScoreTreeNode createScoreTreeNode(int score)
 ItemNode createItemNode(int id)
 {
 	ItemNode node;
-	if(!(node = malloc(sizeof(struct item_node))))
+	if(!(node = allocNode(&freeItemNodes, sizeof(struct item_node))))
 		return NULL;
 	node->itemId = id;
 	node->next = NULL;
 	node->prev = NULL;
-	app_stats.items += 1;
+	node->enqueuedAt = latency_now();
+	stats_add(items, 1);
 	return node;
 }
 ItemTreeNode createItemTreeNode()
 {
 	ItemTreeNode node;
-	if (! (node = malloc(sizeof(struct item_tree_node))))
+	if (! (node = allocNode(&freeItemTreeNodes, sizeof(struct item_tree_node))))
 		return NULL;
 	node->left = NULL;
 	node->right = NULL;
@@ -212,6 +1138,7 @@ ItemTreeNode createItemTreeNode()
 
 void addItemNode(ScoreTreeNode score, ItemNode i)
 {
+	resizePool(score, 1);
 	if(score->head == NULL)
 	{
 		score->head = i;
@@ -228,7 +1155,7 @@ ScoreTreeNode addScoreTreeNode(ScoreTreeNode tree, ScoreTreeNode node)
 	if(tree == NULL)
 	{
 		tree = node;
-		app_stats.pools += 1;
+		stats_add(pools, 1);
 	}
 	else
 	{
@@ -268,8 +1195,8 @@ void deleteItemNode(ItemNode i)
 {
 	if(i->next == NULL && i->prev == NULL)
 	{
-		app_stats.items -= 1;
-		free(i);
+		stats_add(items, -1);
+		freeNode(&freeItemNodes, i);
 	}
 	else
 	{
@@ -281,6 +1208,7 @@ void deleteItemNode(ItemNode i)
 //returns 1 if there is still items in the list, 0 if the list is empty
 int removeItemNode(ScoreTreeNode list, ItemNode i)
 {
+	resizePool(list, -1);
 	if(list->head == i && list->tail == i)
 	{
 		list->head = NULL;
@@ -350,7 +1278,7 @@ ItemTreeNode deleteItemTreeNode(ItemTreeNode tree, ItemTreeNode node)
 		{
 			tree = tree->left;
 		}
-		free(TmpCell);
+		freeNode(&freeItemTreeNodes, TmpCell);
 	}
 
 	return tree;
@@ -382,11 +1310,13 @@ ScoreTreeNode deleteScoreTreeNode(ScoreTreeNode tree, ScoreTreeNode node)
 		TmpCell = findMinScore(tree->right);
 		tree->head = TmpCell->head;
 		tree->tail = TmpCell->tail;
+		tree->count = TmpCell->count;
 		tmpscore = tree->score;
 		tree->score = TmpCell->score;
 		TmpCell->score = tmpscore;
 		TmpCell->head = NULL;
 		TmpCell->tail = NULL;
+		TmpCell->count = 0;
 		tree->right = deleteScoreTreeNode(tree->right, TmpCell);
 	}
 	else
@@ -400,8 +1330,8 @@ ScoreTreeNode deleteScoreTreeNode(ScoreTreeNode tree, ScoreTreeNode node)
 		{
 			tree = tree->left;
 		}
-		free(TmpCell);
-		app_stats.pools -= 1;
+		freeNode(&freeScoreTreeNodes, TmpCell);
+		stats_add(pools, -1);
 	}
 
 	return tree;
@@ -8,6 +8,15 @@
 #ifndef _PQUEUE_H
 #define	_PQUEUE_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include "latency.h"
+
+// Pools are counted by size in power of two buckets, bucket k holding
+// pools of 2^k to 2^(k+1)-1 items.
+#define POOL_SIZE_BUCKETS 32
+
+struct latency_histogram;
 struct item_node;
 struct item_tree_node;
 struct score_tree_node;
@@ -21,6 +30,7 @@ struct item_node {
 	int itemId;
 	struct item_node *prev;
 	struct item_node *next;
+	uint64_t enqueuedAt;
 };
 
 //bst to lookup score pools by score
@@ -30,6 +40,7 @@ struct score_tree_node {
     struct item_node *head;
     struct item_node *tail;
     int score;
+    int count;
 };
 
 //bst to lookup items by item id
@@ -44,6 +55,27 @@ struct item_tree_node {
 ScoreTreeNode score_root;
 ItemTreeNode item_root;
 
+// Free nodes, with the last one kept so the list can be handed over whole.
+struct node_list {
+	void *head;
+	void *tail;
+};
+
+// A queue built while another one is being served and swapped in whole.
+// Its nodes come from free lists of its own until reclaimQueue hands them
+// over to the queue being served.
+struct queue_image {
+	ScoreTreeNode scoreRoot;
+	ItemTreeNode itemRoot;
+	int64_t items;
+	int64_t pools;
+	uint64_t poolSizes[POOL_SIZE_BUCKETS];
+	uint64_t scoreItems[LATENCY_BUCKETS];
+	struct node_list itemNodes;
+	struct node_list itemTreeNodes;
+	struct node_list scoreTreeNodes;
+};
+
 /**
  * These are the functions to access the priority queue
  */
@@ -55,11 +87,42 @@ int getNext();
 int getScore(int itemId);
 // returns 1 on success, 0 on failure
 int update(int itemId, int score);
+// removes a specific item, returns 1 if it was in the queue and 0 if not
+int removeItem(int itemId);
 // iterates through scores and outputs them in the format "itemId score\r\n" to the given file.
 // pass NULL for tree to start at the root of the tree
 void outputScores(FILE *fd);
 void outputScoresIterator(FILE *fd, ScoreTreeNode tree);
+// calls back for every item from the top of the queue down, pools in
+// descending score order and items in a pool in the order NEXT takes
+// them. returns -1 if memory runs out.
+int iterateByPriority(void (*callback)(int itemId, int score, void *arg), void *arg);
+// builds an empty queue from count (itemId, score) pairs in the order
+// iterateByPriority visits them, with both trees balanced. returns -1 if
+// they are out of order, repeat an item or memory runs out, leaving the
+// queue empty.
+int bulkLoad(const int *pairs, size_t count);
+// builds a queue in image from count (itemId, score) pairs without taking
+// the writers' lock or touching the queue being served, on up to threads
+// threads. with updates set the pairs are applied as UPDATEs to an empty
+// queue would apply them, otherwise they must be as for bulkLoad. returns
+// -1 if they are not or memory runs out, leaving the queue in image empty.
+int buildQueue(const int *pairs, size_t count, int updates, int threads, struct queue_image *image);
+// makes image the queue being served and leaves the old one in image.
+void swapQueue(struct queue_image *image);
+// takes the queue in image apart into its free lists, without the
+// writers' lock once the queue is no longer served.
+void releaseQueue(struct queue_image *image);
+// hands the free nodes of image over to the queue being served.
+void reclaimQueue(struct queue_image *image);
 void initializePriorityQueue();
+// Queue shape, kept up to date by the writers and safe to read without
+// their lock. Enqueue times are taken when an item enters the queue and
+// kept while its score changes.
+void getPoolSizes(uint64_t *counts);
+int getScorePercentile(double percentile);
+struct latency_histogram *getWaitTimes();
+int64_t getTopAge();
 void emptyPriorityQueue();
 
 void dumpItems();
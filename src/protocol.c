@@ -0,0 +1,246 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <limits.h>
+#include <string.h>
+
+#include "protocol.h"
+
+int parse_request(char *input, size_t length, int *protocol, token_t *tokens, size_t *ntokens) {
+	if (length == 0) {
+		return 0;
+	}
+	if (*input == '*') {
+		*protocol = PROTOCOL_RESP;
+		return parse_multibulk(input, length, tokens, ntokens);
+	}
+	*protocol = PROTOCOL_INLINE;
+	return parse_inline(input, length, tokens, ntokens);
+}
+
+// memchr is vectorized by the C library, so finding the end of the line
+// costs far less than a byte at a time scan.
+int parse_inline(char *input, size_t length, token_t *tokens, size_t *ntokens) {
+	char *nl = memchr(input, '\n', length);
+	if (nl == NULL) {
+		return length > MAX_INLINE_LENGTH ? -1 : 0;
+	}
+	char *end = nl;
+	*nl = '\0';
+	if (end > input && *(end - 1) == '\r') {
+		*--end = '\0';
+	}
+	*ntokens = tokenize_command(input, end - input, tokens, MAX_TOKENS);
+	return nl - input + 1;
+}
+
+// Reads the decimal length that follows a '*' or '$' marker up to the
+// '\r' ending its line. Returns -1 if the line is malformed.
+static long read_length(const char *p, const char *nl) {
+	long n = 0;
+	if (nl > p && *(nl - 1) == '\r') {
+		nl--;
+	}
+	if (p == nl) {
+		return -1;
+	}
+	for (; p < nl; p++) {
+		unsigned int d = (unsigned char)*p - '0';
+		if (d > 9 || n > MAX_BULK_LENGTH) {
+			return -1;
+		}
+		n = n * 10 + d;
+	}
+	return n;
+}
+
+// Parses a RESP multibulk request ("*<argc>\r\n" followed by argc
+// "$<len>\r\n<data>\r\n" arguments). Arguments are NUL terminated by
+// overwriting their trailing '\r'.
+int parse_multibulk(char *input, size_t length, token_t *tokens, size_t *ntokens) {
+	char *p = input;
+	char *end = input + length;
+	char *nl;
+	long count, bulk;
+	size_t n = 0;
+
+	nl = memchr(p, '\n', end - p);
+	if (nl == NULL) {
+		return length > MAX_INLINE_LENGTH ? -1 : 0;
+	}
+	count = read_length(p + 1, nl);
+	if (count < 0 || count >= MAX_TOKENS) {
+		return -1;
+	}
+	p = nl + 1;
+	while (n < count) {
+		if (p >= end) {
+			return 0;
+		}
+		if (*p != '$') {
+			return -1;
+		}
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			return (end - p) > MAX_INLINE_LENGTH ? -1 : 0;
+		}
+		bulk = read_length(p + 1, nl);
+		if (bulk < 0 || bulk > MAX_BULK_LENGTH) {
+			return -1;
+		}
+		p = nl + 1;
+		if (end - p < bulk + 2) {
+			return 0;
+		}
+		if (p[bulk] != '\r' || p[bulk + 1] != '\n') {
+			return -1;
+		}
+		tokens[n].value = p;
+		tokens[n].length = bulk;
+		n++;
+		p += bulk + 2;
+	}
+	// Arguments are only terminated once the whole request has arrived,
+	// a partial request is parsed again from scratch and must be intact.
+	for (count = 0; count < n; count++) {
+		tokens[count].value[tokens[count].length] = '\0';
+	}
+	if (n > 0) {
+		tokens[n].value = NULL;
+		tokens[n].length = 0;
+		n++;
+	}
+	*ntokens = n;
+	return p - input;
+}
+
+size_t tokenize_command(char *command, size_t length, token_t *tokens, const size_t max_tokens) {
+	char *s, *e;
+	char *end = command + length;
+	size_t ntokens = 0;
+	for (s = e = command; ntokens < max_tokens - 1; ++e) {
+		if (e == end) {
+			if (s != e) {
+				tokens[ntokens].value = s;
+				tokens[ntokens].length = e - s;
+				ntokens++;
+			}
+			break;
+		}
+		if (*e == ' ') {
+			if (s != e) {
+				tokens[ntokens].value = s;
+				tokens[ntokens].length = e - s;
+				ntokens++;
+				*e = '\0';
+			}
+			s = e + 1;
+		}
+	}
+	tokens[ntokens].value = e == end ? NULL : e;
+	tokens[ntokens].length = 0;
+	ntokens++;
+	return ntokens;
+}
+
+// Compares against an upper case command name. Clearing bit 0x20 folds
+// lower case letters onto upper case and can not turn anything else into a
+// letter.
+static int name_is(const char *name, const char *command, size_t length) {
+	size_t i;
+	for (i = 0; i < length; i++) {
+		if ((name[i] & ~0x20) != command[i]) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Command names are unique by length and first letter (PEEK and PING aside)
+// so a lookup is two switches and at most one comparison.
+int lookup_command(const char *name, size_t length) {
+	if (name == NULL) {
+		return COMMAND_UNKNOWN;
+	}
+	switch (length) {
+		case 4:
+			switch (name[0] & ~0x20) {
+				case 'I':
+					return name_is(name, "INFO", 4) ? COMMAND_INFO : COMMAND_UNKNOWN;
+				case 'N':
+					return name_is(name, "NEXT", 4) ? COMMAND_NEXT : COMMAND_UNKNOWN;
+				case 'P':
+					if (name_is(name, "PEEK", 4)) { return COMMAND_PEEK; }
+					return name_is(name, "PING", 4) ? COMMAND_PING : COMMAND_UNKNOWN;
+			}
+			break;
+		case 5:
+			switch (name[0] & ~0x20) {
+				case 'B':
+					return name_is(name, "BNEXT", 5) ? COMMAND_BNEXT : COMMAND_UNKNOWN;
+				case 'S':
+					if (name_is(name, "SCORE", 5)) { return COMMAND_SCORE; }
+					return name_is(name, "STATS", 5) ? COMMAND_STATS : COMMAND_UNKNOWN;
+			}
+			break;
+		case 6:
+			return name_is(name, "UPDATE", 6) ? COMMAND_UPDATE : COMMAND_UNKNOWN;
+		case 7:
+			if (name_is(name, "MUPDATE", 7)) { return COMMAND_MUPDATE; }
+			return name_is(name, "SLOWLOG", 7) ? COMMAND_SLOWLOG : COMMAND_UNKNOWN;
+	}
+	return COMMAND_UNKNOWN;
+}
+
+int token_is(const token_t *token, const char *keyword) {
+	size_t length = strlen(keyword);
+	return token->value != NULL && token->length == length && name_is(token->value, keyword, length);
+}
+
+int parse_integer(const token_t *token, int *value) {
+	const char *p = token->value;
+	const char *end;
+	unsigned int limit = INT_MAX;
+	unsigned int n = 0;
+	int negative = 0;
+	if (p == NULL || token->length == 0) {
+		return -1;
+	}
+	end = p + token->length;
+	if (*p == '-') {
+		negative = 1;
+		limit = (unsigned int)INT_MAX + 1;
+		if (++p == end) {
+			return -1;
+		}
+	}
+	for (; p < end; p++) {
+		unsigned int d = (unsigned char)*p - '0';
+		if (d > 9 || n > (limit - d) / 10) {
+			return -1;
+		}
+		n = n * 10 + d;
+	}
+	*value = negative ? -(int)(n - 1) - 1 : (int)n;
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __PROTOCOL_H__
+#define __PROTOCOL_H__
+
+#include <stddef.h>
+
+#define COMMAND_TOKEN		0
+#define SUBCOMMAND_TOKEN	1
+#define KEY_TOKEN			1
+#define VALUE_TOKEN			2
+#define MAX_TOKENS			64
+
+// Longest inline command line and longest multibulk argument accepted
+// before the client is considered to be speaking garbage.
+#define MAX_INLINE_LENGTH	1024
+#define MAX_BULK_LENGTH		1024
+
+// Wire protocol a request arrived in, replies are encoded to match.
+#define PROTOCOL_INLINE		0
+#define PROTOCOL_RESP		1
+
+enum command_type {
+	COMMAND_UNKNOWN = 0,
+	COMMAND_UPDATE,
+	COMMAND_MUPDATE,
+	COMMAND_NEXT,
+	COMMAND_BNEXT,
+	COMMAND_PEEK,
+	COMMAND_SCORE,
+	COMMAND_INFO,
+	COMMAND_PING,
+	COMMAND_STATS,
+	COMMAND_SLOWLOG,
+	COMMAND_COUNT
+};
+
+typedef struct token_s {
+	char *value;
+	size_t length;
+} token_t;
+
+// Parses one request from the front of input, in place. Returns the number
+// of bytes the request used, 0 if it is not complete yet or -1 if the input
+// can not be parsed. Every token is NUL terminated and the token list ends
+// with a terminator token whose value is NULL, so "NEXT" yields 2 tokens.
+int parse_request(char *input, size_t length, int *protocol, token_t *tokens, size_t *ntokens);
+int parse_inline(char *input, size_t length, token_t *tokens, size_t *ntokens);
+int parse_multibulk(char *input, size_t length, token_t *tokens, size_t *ntokens);
+size_t tokenize_command(char *command, size_t length, token_t *tokens, const size_t max_tokens);
+
+// Maps a command name, in any case, to its command_type.
+int lookup_command(const char *name, size_t length);
+
+// Compares a subcommand or option token, in any case, to an upper case
+// keyword.
+int token_is(const token_t *token, const char *keyword);
+
+// Parses a base 10 integer that must fill the whole token. Returns 0 on
+// success and -1 for empty, malformed or out of range input.
+int parse_integer(const token_t *token, int *value);
+
+#endif
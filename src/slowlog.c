@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "slowlog.h"
+
+// Entries are added from the network, engine and snapshot threads, but
+// only for slow commands, so a plain mutex is cheap enough.
+static pthread_mutex_t slowlog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct slowlog_entry slowlog[SLOWLOG_ENTRIES];
+static uint64_t next_id = 0;
+static unsigned int length_used = 0;
+
+static void format_client(char *out, size_t size, int fd) {
+	struct sockaddr_in addr;
+	socklen_t addr_length = sizeof(addr);
+	char ip[INET_ADDRSTRLEN];
+	if (fd < 0) {
+		snprintf(out, size, "-");
+		return;
+	}
+	if (getpeername(fd, (struct sockaddr *)&addr, &addr_length) < 0 || addr.sin_family != AF_INET ||
+			inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip)) == NULL) {
+		snprintf(out, size, "fd=%d", fd);
+		return;
+	}
+	snprintf(out, size, "%s:%d", ip, ntohs(addr.sin_port));
+}
+
+// Arguments are truncated and anything unprintable is replaced so entries
+// are always one line. fd is the client's socket or -1 for work the server
+// did on its own.
+void slowlog_add(const char *command, const char *args, size_t length, uint64_t duration, int fd) {
+	struct slowlog_entry entry;
+	size_t i;
+	time(&entry.timestamp);
+	entry.duration = duration;
+	snprintf(entry.command, sizeof(entry.command), "%s", command);
+	if (length > sizeof(entry.args) - 1) {
+		length = sizeof(entry.args) - 1;
+	}
+	for (i = 0; i < length; i++) {
+		entry.args[i] = args[i] >= 0x20 && args[i] < 0x7f ? args[i] : '?';
+	}
+	entry.args[length] = '\0';
+	format_client(entry.client, sizeof(entry.client), fd);
+	pthread_mutex_lock(&slowlog_mutex);
+	entry.id = next_id++;
+	slowlog[entry.id % SLOWLOG_ENTRIES] = entry;
+	if (length_used < SLOWLOG_ENTRIES) {
+		length_used++;
+	}
+	pthread_mutex_unlock(&slowlog_mutex);
+}
+
+// Copies up to count entries, newest first, and returns how many.
+int slowlog_get(struct slowlog_entry *entries, int count) {
+	int n;
+	pthread_mutex_lock(&slowlog_mutex);
+	for (n = 0; n < count && n < length_used; n++) {
+		entries[n] = slowlog[(next_id - 1 - n) % SLOWLOG_ENTRIES];
+	}
+	pthread_mutex_unlock(&slowlog_mutex);
+	return n;
+}
+
+unsigned int slowlog_len() {
+	unsigned int length;
+	pthread_mutex_lock(&slowlog_mutex);
+	length = length_used;
+	pthread_mutex_unlock(&slowlog_mutex);
+	return length;
+}
+
+// Ids keep counting up across resets.
+void slowlog_reset() {
+	pthread_mutex_lock(&slowlog_mutex);
+	length_used = 0;
+	pthread_mutex_unlock(&slowlog_mutex);
+}
@@ -0,0 +1,56 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __SLOWLOG_H__
+#define __SLOWLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// The newest SLOWLOG_ENTRIES slow commands are kept, with up to
+// SLOWLOG_ARGS bytes of their arguments.
+#define SLOWLOG_ENTRIES		128
+#define SLOWLOG_ARGS		64
+#define DEFAULT_SLOWLOG_USEC	10000
+
+struct slowlog_entry {
+	uint64_t id;
+	time_t timestamp;
+	uint64_t duration;
+	char command[16];
+	char args[SLOWLOG_ARGS];
+	char client[48];
+};
+
+// Commands taking at least this many nanoseconds are logged, UINT64_MAX
+// disables the log. Callers compare against it before calling slowlog_add
+// so fast commands pay for a single comparison.
+uint64_t slowlog_threshold;
+
+void slowlog_add(const char *command, const char *args, size_t length, uint64_t duration, int fd);
+int slowlog_get(struct slowlog_entry *entries, int count);
+unsigned int slowlog_len();
+void slowlog_reset();
+
+#endif
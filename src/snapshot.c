@@ -0,0 +1,790 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <err.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "pqueue.h"
+#include "snapshot.h"
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+#define DIRTY_NONE		UINT32_MAX
+#define DIRTY_SLOTS		1024
+// Text snapshots are parsed on up to MAX_TEXT_RANGES threads, with at
+// least TEXT_RANGE_BYTES each.
+#define MAX_TEXT_RANGES		64
+#define TEXT_RANGE_BYTES	(1024 * 1024)
+
+// Changed items since the last snapshot, only touched under scores_mutex.
+// The count is kept apart for INFO.
+static struct dirty_set *dirty = NULL;
+static size_t dirty_count = 0;
+
+// The record before, that packed records are the difference from.
+struct packer {
+	int64_t item_id;
+	int64_t score;
+};
+
+struct snapshot_writer {
+	FILE *out;
+	struct snapshot_header header;
+	int last_score;
+	int failed;
+	int packed;
+	struct packer packer;
+};
+
+static inline uint64_t checksum_record(uint64_t checksum, const int *record)
+{
+	uint64_t word;
+	memcpy(&word, record, sizeof(word));
+	return (checksum ^ word) * FNV_PRIME;
+}
+
+static inline uint64_t zigzag(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline void pack_varint(FILE *out, uint64_t value)
+{
+	while (value >= 0x80) {
+		putc_unlocked((int)(value & 0x7f) | 0x80, out);
+		value >>= 7;
+	}
+	putc_unlocked((int)value, out);
+}
+
+// Errors are left for ferror() to find.
+static void pack_record(FILE *out, struct packer *packer, const int *record)
+{
+	int64_t score = (int64_t)record[1] - packer->score;
+	pack_varint(out, zigzag((int64_t)record[0] - packer->item_id) << 1 | (score != 0));
+	if (score != 0) {
+		pack_varint(out, zigzag(score));
+	}
+	packer->item_id = record[0];
+	packer->score = record[1];
+}
+
+static inline const uint8_t *unpack_varint(const uint8_t *p, const uint8_t *end, uint64_t *value)
+{
+	uint64_t result = 0;
+	int shift;
+	for (shift = 0; p < end && shift < 64; shift += 7) {
+		result |= (uint64_t)(*p & 0x7f) << shift;
+		if ((*p++ & 0x80) == 0) {
+			*value = result;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Unpacks count records from p into records. Returns -1 unless they fit
+// in 32 bits and end right at end.
+static int unpack_records(const uint8_t *p, const uint8_t *end, int *records, uint64_t count)
+{
+	int64_t item_id = 0, score = 0;
+	uint64_t value, i;
+	for (i = 0; i < count; i++) {
+		if ((p = unpack_varint(p, end, &value)) == NULL) {
+			return -1;
+		}
+		item_id += unzigzag(value >> 1);
+		if ((value & 1) != 0) {
+			if ((p = unpack_varint(p, end, &value)) == NULL) {
+				return -1;
+			}
+			score += unzigzag(value);
+		}
+		if (item_id < INT32_MIN || item_id > INT32_MAX || score < INT32_MIN || score > INT32_MAX) {
+			return -1;
+		}
+		records[2 * i] = item_id;
+		records[2 * i + 1] = score;
+	}
+	return p == end ? 0 : -1;
+}
+
+// Checks the records after a header of the given record size fill the rest
+// of the file, and unpacks them into unpacked if they are packed, which
+// the caller frees. Returns NULL if they do not.
+static const int *snapshot_records(const char *filename, const void *data, size_t size, size_t header_size,
+		uint32_t record_size, uint64_t count, int **unpacked)
+{
+	const uint8_t *begin = (const uint8_t *)data + header_size, *end = (const uint8_t *)data + size;
+	*unpacked = NULL;
+	if (size < header_size) {
+		return NULL;
+	}
+	if (record_size == 2 * sizeof(int)) {
+		return (size - header_size) % record_size == 0 && count == (size - header_size) / record_size ?
+			(const int *)begin : NULL;
+	}
+	// Every packed record takes at least a byte.
+	if (record_size != SNAPSHOT_RECORD_PACKED || count > size - header_size) {
+		return NULL;
+	}
+	// One more so an empty snapshot does not look like running out of memory.
+	if ((*unpacked = malloc(count * 2 * sizeof(int) + 1)) == NULL) {
+		fprintf(stderr, "%s: out of memory unpacking snapshot\n", filename);
+		return NULL;
+	}
+	if (unpack_records(begin, end, *unpacked, count) < 0) {
+		free(*unpacked);
+		*unpacked = NULL;
+		return NULL;
+	}
+	return *unpacked;
+}
+
+static void write_record(int item_id, int score, void *arg)
+{
+	struct snapshot_writer *writer = arg;
+	int record[2] = { item_id, score };
+	if (writer->header.items == 0 || score != writer->last_score) {
+		writer->header.pools++;
+		writer->last_score = score;
+	}
+	writer->header.items++;
+	writer->header.checksum = checksum_record(writer->header.checksum, record);
+	if (writer->packed) {
+		pack_record(writer->out, &writer->packer, record);
+	} else if (fwrite(record, sizeof(record), 1, writer->out) != 1) {
+		writer->failed = 1;
+	}
+}
+
+// Writes a binary snapshot of the queue to the start of out, the header
+// last once the counts and checksum are known, with packed records for
+// --snapshot-format=packed. Returns -1 on failure.
+int snapshot_write(FILE *out)
+{
+	struct snapshot_writer writer;
+	memset(&writer, 0, sizeof(writer));
+	writer.out = out;
+	writer.packed = snapshot_format == SNAPSHOT_FORMAT_PACKED;
+	memcpy(writer.header.magic, SNAPSHOT_MAGIC, sizeof(writer.header.magic));
+	writer.header.version = writer.packed ? SNAPSHOT_VERSION : SNAPSHOT_BINARY_VERSION;
+	writer.header.record_size = writer.packed ? SNAPSHOT_RECORD_PACKED : 2 * sizeof(int);
+	writer.header.checksum = FNV_OFFSET;
+	writer.header.generation = journal_generation();
+	if (fwrite(&writer.header, sizeof(writer.header), 1, out) != 1) {
+		return -1;
+	}
+	if (iterateByPriority(write_record, &writer) < 0 || writer.failed || ferror(out)) {
+		return -1;
+	}
+	if (fseek(out, 0, SEEK_SET) < 0 || fwrite(&writer.header, sizeof(writer.header), 1, out) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+// Maps a binary snapshot and builds a queue from it in image, off to the
+// side of the one being served, and sets generation to the journal
+// generation it was taken at. Returns 1 once built, 0 if the file is
+// missing or not a binary snapshot and -1 if it is damaged, in which case
+// nothing or only part of it was built.
+int snapshot_load(const char *filename, struct queue_image *image, uint64_t *generation)
+{
+	struct snapshot_header *header;
+	struct stat st;
+	const int *records;
+	int *unpacked = NULL;
+	uint64_t checksum = FNV_OFFSET, i;
+	size_t header_size = sizeof(*header);
+	void *data;
+	int fd, rval = 1;
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)offsetof(struct snapshot_header, generation)) {
+		close(fd);
+		return 0;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	header = data;
+	if (header->version == 1) {
+		header_size = offsetof(struct snapshot_header, generation);
+	}
+	if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+		rval = 0;
+	} else if (header->version < 1 || header->version > SNAPSHOT_VERSION ||
+			(header->version < 3 && header->record_size == SNAPSHOT_RECORD_PACKED) ||
+			(records = snapshot_records(filename, data, st.st_size, header_size, header->record_size, header->items, &unpacked)) == NULL) {
+		fprintf(stderr, "%s: unsupported, truncated or damaged snapshot\n", filename);
+		rval = -1;
+	} else {
+		for (i = 0; i < header->items; i++) {
+			checksum = checksum_record(checksum, records + 2 * i);
+		}
+		if (checksum != header->checksum) {
+			fprintf(stderr, "%s: snapshot checksum mismatch\n", filename);
+			rval = -1;
+		} else if (buildQueue(records, header->items, 0, load_threads, image) < 0) {
+			fprintf(stderr, "%s: could not load snapshot\n", filename);
+			rval = -1;
+		} else if (generation != NULL) {
+			*generation = header_size < sizeof(*header) ? 0 : header->generation;
+		}
+	}
+	free(unpacked);
+	munmap(data, st.st_size);
+	return rval;
+}
+
+struct text_range {
+	const char *begin;
+	const char *end;
+	int *pairs;
+	size_t count;
+	size_t capacity;
+	int failed;
+};
+
+// Reads an integer as %d would, returns NULL if there is none or it does
+// not fit in an int.
+static const char *parse_int(const char *p, const char *end, int *value)
+{
+	unsigned int n = 0, limit = INT_MAX, d;
+	int negative = 0;
+	while (p < end && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p++ == '-';
+	}
+	if (negative) {
+		limit = (unsigned int)INT_MAX + 1;
+	}
+	if (p == end || *p < '0' || *p > '9') {
+		return NULL;
+	}
+	while (p < end && *p >= '0' && *p <= '9') {
+		d = *p++ - '0';
+		if (n > (limit - d) / 10) {
+			return NULL;
+		}
+		n = n * 10 + d;
+	}
+	*value = negative ? -(int)(n - 1) - 1 : (int)n;
+	return p;
+}
+
+static void *parse_text_range(void *arg)
+{
+	struct text_range *range = arg;
+	const char *line = range->begin, *next, *p;
+	int item_id, score, *larger;
+	while (line < range->end) {
+		next = memchr(line, '\n', range->end - line);
+		next = next == NULL ? range->end : next + 1;
+		if ((p = parse_int(line, next, &item_id)) != NULL && parse_int(p, next, &score) != NULL) {
+			if (range->count == range->capacity) {
+				range->capacity = range->capacity > 0 ? range->capacity * 2 : 4096;
+				if ((larger = realloc(range->pairs, range->capacity * 2 * sizeof(*larger))) == NULL) {
+					range->failed = 1;
+					return NULL;
+				}
+				range->pairs = larger;
+			}
+			range->pairs[2 * range->count] = item_id;
+			range->pairs[2 * range->count + 1] = score;
+			range->count++;
+		}
+		line = next;
+	}
+	return NULL;
+}
+
+// Text snapshots, as written by --snapshot-format=text, are split at line
+// ends and parsed in parallel, then their lines are applied as UPDATEs.
+// Returns 1 once built, 0 if the file is missing and -1 if memory runs
+// out.
+int snapshot_load_text(const char *filename, struct queue_image *image)
+{
+	struct text_range ranges[MAX_TEXT_RANGES];
+	pthread_t threads[MAX_TEXT_RANGES];
+	int started[MAX_TEXT_RANGES], *pairs = NULL;
+	struct stat st;
+	const char *data = NULL;
+	size_t i, n = 1, count = 0, offset;
+	int fd, rval = 1;
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if (st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	}
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	if (load_threads > 1 && (size_t)st.st_size / TEXT_RANGE_BYTES > 1) {
+		n = st.st_size / TEXT_RANGE_BYTES;
+		if (n > (size_t)load_threads) {
+			n = load_threads;
+		}
+		if (n > MAX_TEXT_RANGES) {
+			n = MAX_TEXT_RANGES;
+		}
+	}
+	memset(ranges, 0, sizeof(ranges));
+	for (i = 0; i < n; i++) {
+		offset = st.st_size * i / n;
+		while (offset > 0 && offset < (size_t)st.st_size && data[offset - 1] != '\n') {
+			offset++;
+		}
+		ranges[i].begin = data + offset;
+		if (i > 0) {
+			ranges[i - 1].end = ranges[i].begin;
+		}
+	}
+	ranges[n - 1].end = data + st.st_size;
+	for (i = 1; i < n; i++) {
+		started[i] = pthread_create(&threads[i], NULL, parse_text_range, &ranges[i]) == 0;
+	}
+	parse_text_range(&ranges[0]);
+	for (i = 1; i < n; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		} else {
+			parse_text_range(&ranges[i]);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		rval = ranges[i].failed ? -1 : rval;
+		count += ranges[i].count;
+	}
+	if (rval > 0 && count > 0 && (pairs = malloc(2 * count * sizeof(*pairs))) == NULL) {
+		rval = -1;
+	}
+	for (i = 0, count = 0; i < n; i++) {
+		if (pairs != NULL) {
+			memcpy(pairs + 2 * count, ranges[i].pairs, 2 * ranges[i].count * sizeof(*pairs));
+			count += ranges[i].count;
+		}
+		free(ranges[i].pairs);
+	}
+	if (data != NULL) {
+		munmap((void *)data, st.st_size);
+	}
+	if (rval > 0 && buildQueue(pairs, count, 1, load_threads, image) < 0) {
+		rval = -1;
+	}
+	free(pairs);
+	if (rval < 0) {
+		fprintf(stderr, "%s: out of memory loading snapshot\n", filename);
+	}
+	return rval;
+}
+
+static struct dirty_set *dirty_new()
+{
+	struct dirty_set *set = calloc(1, sizeof(*set));
+	if (set == NULL || (set->slots = calloc(DIRTY_SLOTS, sizeof(*set->slots))) == NULL) {
+		err(1, "could not track changed items");
+	}
+	set->mask = DIRTY_SLOTS - 1;
+	set->head = DIRTY_NONE;
+	set->tail = DIRTY_NONE;
+	return set;
+}
+
+static inline size_t dirty_slot(int item_id, size_t mask)
+{
+	return (((uint64_t)(uint32_t)item_id * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+static void dirty_grow(struct dirty_set *set)
+{
+	size_t mask = set->mask * 2 + 1, slot;
+	uint32_t *slots = calloc(mask + 1, sizeof(*slots)), i;
+	if (slots == NULL) {
+		err(1, "could not track changed items");
+	}
+	for (i = 0; i < set->count; i++) {
+		slot = dirty_slot(set->entries[i].item_id, mask);
+		while (slots[slot] != 0) {
+			slot = (slot + 1) & mask;
+		}
+		slots[slot] = i + 1;
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->mask = mask;
+}
+
+static void dirty_append(struct dirty_set *set, uint32_t index)
+{
+	set->entries[index].prev = set->tail;
+	set->entries[index].next = DIRTY_NONE;
+	if (set->tail == DIRTY_NONE) {
+		set->head = index;
+	} else {
+		set->entries[set->tail].next = index;
+	}
+	set->tail = index;
+}
+
+static void dirty_unlink(struct dirty_set *set, uint32_t index)
+{
+	struct dirty_entry *entry = &set->entries[index];
+	if (entry->prev == DIRTY_NONE) {
+		set->head = entry->next;
+	} else {
+		set->entries[entry->prev].next = entry->next;
+	}
+	if (entry->next == DIRTY_NONE) {
+		set->tail = entry->prev;
+	} else {
+		set->entries[entry->next].prev = entry->prev;
+	}
+}
+
+// Called under scores_mutex for every change to the queue while delta
+// snapshots are on. An item changed again moves to the end.
+void snapshot_track(int item_id)
+{
+	struct dirty_set *set;
+	size_t slot;
+	uint32_t index;
+	if (dirty == NULL) {
+		dirty = dirty_new();
+	}
+	set = dirty;
+	for (slot = dirty_slot(item_id, set->mask); set->slots[slot] != 0; slot = (slot + 1) & set->mask) {
+		index = set->slots[slot] - 1;
+		if (set->entries[index].item_id == item_id) {
+			if (index != set->tail) {
+				dirty_unlink(set, index);
+				dirty_append(set, index);
+			}
+			return;
+		}
+	}
+	if (set->count == set->capacity) {
+		size_t grown = set->capacity > 0 ? set->capacity * 2 : DIRTY_SLOTS / 2;
+		struct dirty_entry *entries = realloc(set->entries, grown * sizeof(*entries));
+		if (entries == NULL) {
+			err(1, "could not track changed items");
+		}
+		set->entries = entries;
+		set->capacity = grown;
+	}
+	index = set->count++;
+	set->entries[index].item_id = item_id;
+	set->slots[slot] = index + 1;
+	dirty_append(set, index);
+	if (set->count * 2 > set->mask + 1) {
+		dirty_grow(set);
+	}
+	__atomic_store_n(&dirty_count, set->count, __ATOMIC_RELAXED);
+}
+
+size_t snapshot_dirty_count()
+{
+	return __atomic_load_n(&dirty_count, __ATOMIC_RELAXED);
+}
+
+// Hands over the items changed so far, under scores_mutex, and starts
+// tracking from scratch. Returns NULL if nothing changed.
+struct dirty_set *snapshot_take_dirty()
+{
+	struct dirty_set *set = dirty;
+	dirty = NULL;
+	__atomic_store_n(&dirty_count, 0, __ATOMIC_RELAXED);
+	return set;
+}
+
+void snapshot_free_dirty(struct dirty_set *set)
+{
+	if (set == NULL) {
+		return;
+	}
+	free(set->entries);
+	free(set->slots);
+	free(set);
+}
+
+// Writes the delta since the snapshot of generation since, with the
+// current journal generation, from the queue as it is now. Run by the
+// snapshot child on its copy of the queue. Returns -1 on failure.
+int snapshot_write_delta(FILE *out, struct dirty_set *set, uint64_t since)
+{
+	struct snapshot_delta_header header;
+	struct packer packer = { 0, 0 };
+	ItemTreeNode node;
+	uint32_t index;
+	int pass, record[2], packed = snapshot_format == SNAPSHOT_FORMAT_PACKED;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SNAPSHOT_DELTA_MAGIC, sizeof(header.magic));
+	header.version = packed ? SNAPSHOT_DELTA_VERSION : SNAPSHOT_DELTA_BINARY_VERSION;
+	header.record_size = packed ? SNAPSHOT_RECORD_PACKED : sizeof(record);
+	header.checksum = FNV_OFFSET;
+	header.since = since;
+	header.generation = journal_generation();
+	if (fwrite(&header, sizeof(header), 1, out) != 1) {
+		return -1;
+	}
+	// Removed items first, then the changed ones.
+	for (pass = 0; pass < 2 && set != NULL; pass++) {
+		for (index = set->head; index != DIRTY_NONE; index = set->entries[index].next) {
+			record[0] = set->entries[index].item_id;
+			node = findItem(record[0], item_root);
+			if ((node == NULL) != (pass == 0)) {
+				continue;
+			}
+			record[1] = node != NULL ? node->score : 0;
+			if (pass == 0) {
+				header.deletes++;
+			} else {
+				header.upserts++;
+			}
+			header.checksum = checksum_record(header.checksum, record);
+			if (packed) {
+				pack_record(out, &packer, record);
+			} else if (fwrite(record, sizeof(record), 1, out) != 1) {
+				return -1;
+			}
+		}
+	}
+	if (ferror(out) || fseek(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+void snapshot_delta_filename(char *out, size_t size, const char *snapshot, uint64_t generation)
+{
+	snprintf(out, size, "%s.delta.%" PRIu64, snapshot, generation);
+}
+
+static int compare_generations(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Lists the generations of the deltas of a snapshot, oldest first.
+// Returns the number found.
+static size_t list_deltas(const char *snapshot, uint64_t **generations)
+{
+	char pattern[4096], *end;
+	glob_t found;
+	size_t i, n = 0, prefix;
+	snapshot_delta_filename(pattern, sizeof(pattern), snapshot, 0);
+	prefix = strlen(pattern) - 1;
+	strcpy(pattern + prefix, "*");
+	*generations = NULL;
+	if (glob(pattern, 0, NULL, &found) != 0) {
+		return 0;
+	}
+	*generations = malloc(found.gl_pathc * sizeof(**generations));
+	if (*generations == NULL) {
+		err(1, "could not list snapshot deltas");
+	}
+	for (i = 0; i < found.gl_pathc; i++) {
+		const char *suffix = found.gl_pathv[i] + prefix;
+		uint64_t value = strtoull(suffix, &end, 10);
+		if (end != suffix && *end == '\0') {
+			(*generations)[n++] = value;
+		}
+	}
+	globfree(&found);
+	qsort(*generations, n, sizeof(**generations), compare_generations);
+	return n;
+}
+
+static int apply_delta(const char *filename, uint64_t *generation)
+{
+	struct snapshot_delta_header *header;
+	struct stat st;
+	const int *records;
+	int *unpacked = NULL;
+	uint64_t checksum = FNV_OFFSET, i;
+	void *data;
+	int fd, rval = 0;
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		warn("%s", filename);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(*header)) {
+		fprintf(stderr, "%s: truncated snapshot delta\n", filename);
+		close(fd);
+		return -1;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return -1;
+	}
+	header = data;
+	if (memcmp(header->magic, SNAPSHOT_DELTA_MAGIC, sizeof(header->magic)) != 0 ||
+			header->version < 1 || header->version > SNAPSHOT_DELTA_VERSION ||
+			(header->version < 2 && header->record_size == SNAPSHOT_RECORD_PACKED) ||
+			header->deletes > st.st_size || header->upserts > st.st_size ||
+			(records = snapshot_records(filename, data, st.st_size, sizeof(*header), header->record_size,
+				header->deletes + header->upserts, &unpacked)) == NULL) {
+		fprintf(stderr, "%s: unsupported, truncated or damaged snapshot delta\n", filename);
+		rval = -1;
+	} else if (header->since != *generation) {
+		fprintf(stderr, "%s: does not follow the snapshot of generation %" PRIu64 "\n", filename, *generation);
+		rval = -1;
+	} else {
+		for (i = 0; i < header->deletes + header->upserts; i++) {
+			checksum = checksum_record(checksum, records + 2 * i);
+		}
+		if (checksum != header->checksum) {
+			fprintf(stderr, "%s: snapshot delta checksum mismatch\n", filename);
+			rval = -1;
+		}
+	}
+	if (rval == 0) {
+		for (i = 0; i < header->deletes + header->upserts; i++) {
+			removeItem(records[2 * i]);
+			if (i >= header->deletes && update(records[2 * i], records[2 * i + 1]) < 0) {
+				rval = -1;
+				break;
+			}
+		}
+		*generation = header->generation;
+	}
+	free(unpacked);
+	munmap(data, st.st_size);
+	return rval;
+}
+
+// Applies the deltas following the snapshot of the given generation in
+// order and advances generation to the last one applied. Deltas older than
+// the snapshot are removed. Returns -1 if one is damaged or does not
+// follow the one before it.
+int snapshot_load_deltas(const char *snapshot, uint64_t *generation)
+{
+	char filename[4096];
+	uint64_t *generations;
+	size_t i, n;
+	int rval = 0;
+	n = list_deltas(snapshot, &generations);
+	for (i = 0; i < n && rval == 0; i++) {
+		snapshot_delta_filename(filename, sizeof(filename), snapshot, generations[i]);
+		if (generations[i] <= *generation) {
+			unlink(filename);
+		} else {
+			rval = apply_delta(filename, generation);
+		}
+	}
+	free(generations);
+	return rval;
+}
+
+// The generation the snapshot and its deltas reach going by the header and
+// the file names alone, for the journal to start past it before they are
+// loaded.
+uint64_t snapshot_peek_generation(const char *snapshot)
+{
+	struct snapshot_header header;
+	uint64_t *generations, generation = 0;
+	size_t n;
+	FILE *in = fopen(snapshot, "r");
+	if (in != NULL) {
+		if (fread(&header, sizeof(header), 1, in) == 1 && memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0 &&
+				header.version >= 2) {
+			generation = header.generation;
+		}
+		fclose(in);
+	}
+	n = list_deltas(snapshot, &generations);
+	if (n > 0 && generations[n - 1] > generation) {
+		generation = generations[n - 1];
+	}
+	free(generations);
+	return generation;
+}
+
+// Removes the deltas a full snapshot of the given generation replaced.
+void snapshot_remove_deltas(const char *snapshot, uint64_t generation)
+{
+	char filename[4096];
+	uint64_t *generations;
+	size_t i, n;
+	n = list_deltas(snapshot, &generations);
+	for (i = 0; i < n && generations[i] < generation; i++) {
+		snapshot_delta_filename(filename, sizeof(filename), snapshot, generations[i]);
+		unlink(filename);
+	}
+	free(generations);
+}
+
+// Fsyncs the directory holding a file, so that a rename into it survives
+// a crash before the files it replaced are removed. Returns -1 on failure.
+int snapshot_sync_dir(const char *filename)
+{
+	char dir[4096];
+	const char *slash = strrchr(filename, '/');
+	int fd, result;
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == filename) {
+		strcpy(dir, "/");
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+	}
+	fd = open(dir, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	result = fsync(fd);
+	close(fd);
+	return result;
+}
@@ -0,0 +1,122 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct queue_image;
+
+#define SNAPSHOT_FORMAT_BINARY	0
+#define SNAPSHOT_FORMAT_TEXT	1
+#define SNAPSHOT_FORMAT_PACKED	2
+
+// Binary snapshots are this header followed by one (item id, score) pair
+// of 32-bit integers per item, from the top of the queue down, in host
+// byte order. The checksum is FNV-1a over the records taken 64 bits at a
+// time. Text snapshots are "<item id> <score>\n" lines and are still read.
+// Version 1 headers end before the journal generation.
+//
+// Version 3 adds packed records, marked by a record size of 0: per record
+// a varint of the zigzag encoded difference from the item id before,
+// shifted left by one with the low bit set when the score differs from the
+// one before, followed in that case by a varint of the zigzag encoded
+// difference from that score. Scores are thereby stored once per pool.
+// The checksum is over the records unpacked. Snapshots that are not
+// packed are still written as version 2 for older servers to read.
+#define SNAPSHOT_MAGIC		"BARBSNAP"
+#define SNAPSHOT_VERSION	3
+#define SNAPSHOT_BINARY_VERSION	2
+#define SNAPSHOT_RECORD_PACKED	0
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t items;
+	uint64_t pools;
+	uint64_t checksum;
+	uint64_t generation;
+};
+
+// Delta snapshots, "<snapshot>.delta.<generation>", hold the items that
+// changed since the snapshot of generation since: the items removed, then
+// the (item id, score) of the items changed, in the order they last
+// changed so items keep their place in their pools. Restoring removes and
+// then sets them in order on top of the snapshots before. Version 2 adds
+// packed records like full snapshots, with the score of removed items 0.
+#define SNAPSHOT_DELTA_MAGIC	"BARBDLTA"
+#define SNAPSHOT_DELTA_VERSION	2
+#define SNAPSHOT_DELTA_BINARY_VERSION	1
+
+struct snapshot_delta_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t deletes;
+	uint64_t upserts;
+	uint64_t checksum;
+	uint64_t since;
+	uint64_t generation;
+};
+
+// Items changed since the last snapshot, in the order they last changed.
+struct dirty_entry {
+	int item_id;
+	uint32_t prev;
+	uint32_t next;
+};
+
+struct dirty_set {
+	struct dirty_entry *entries;
+	size_t count;
+	size_t capacity;
+	// Entry index + 1 per slot, 0 for empty slots
+	uint32_t *slots;
+	size_t mask;
+	uint32_t head;
+	uint32_t tail;
+};
+
+// Set by --snapshot-format, --snapshot-deltas and --load-threads.
+int snapshot_format;
+int snapshot_deltas;
+int load_threads;
+
+int snapshot_write(FILE *out);
+int snapshot_load(const char *filename, struct queue_image *image, uint64_t *generation);
+int snapshot_load_text(const char *filename, struct queue_image *image);
+void snapshot_track(int item_id);
+size_t snapshot_dirty_count();
+struct dirty_set *snapshot_take_dirty();
+void snapshot_free_dirty(struct dirty_set *set);
+int snapshot_write_delta(FILE *out, struct dirty_set *set, uint64_t since);
+void snapshot_delta_filename(char *out, size_t size, const char *snapshot, uint64_t generation);
+int snapshot_load_deltas(const char *snapshot, uint64_t *generation);
+uint64_t snapshot_peek_generation(const char *snapshot);
+void snapshot_remove_deltas(const char *snapshot, uint64_t generation);
+int snapshot_sync_dir(const char *filename);
+
+#endif
@@ -0,0 +1,61 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <err.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+__thread struct thread_stats *local_stats = NULL;
+
+// Threads are only ever added, a thread's counters outlive it since they
+// hold its share of the totals.
+static struct thread_stats *all_stats = NULL;
+static pthread_mutex_t register_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct thread_stats *stats_register()
+{
+	struct thread_stats *stats;
+	if (posix_memalign((void **)&stats, STATS_CACHE_LINE, sizeof(struct thread_stats)) != 0) {
+		err(1, "malloc failed");
+	}
+	memset(stats, 0, sizeof(struct thread_stats));
+	pthread_mutex_lock(&register_mutex);
+	stats->next = all_stats;
+	__atomic_store_n(&all_stats, stats, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&register_mutex);
+	local_stats = stats;
+	return stats;
+}
+
+uint64_t stats_sum(size_t offset)
+{
+	struct thread_stats *stats;
+	uint64_t total = 0;
+	for (stats = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); stats != NULL; stats = stats->next) {
+		total += __atomic_load_n((uint64_t *)((char *)stats + offset), __ATOMIC_RELAXED);
+	}
+	return total;
+}
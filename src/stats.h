@@ -23,17 +23,107 @@ THE SOFTWARE.
 #ifndef __STATS_H__
 #define __STATS_H__
 
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
 
+#define STATS_CACHE_LINE	64
+
 struct _app_stats {
 	time_t started_at;
 	char *version;
+	// Absolute values rather than counts, set by the network thread: the
+	// kernel's count of dropped UDP datagrams and the operations waiting
+	// for the engine thread
+	uint32_t udp_kernel_drops;
+	unsigned int engine_in_flight;
+	// Set by the snapshot thread: whether a child is writing a snapshot,
+	// whether the last one failed, how long it took, its size and how long
+	// the queue was locked while forking it
+	int snapshot_in_progress;
+	int snapshot_failed;
+	uint64_t snapshots;
+	uint64_t snapshot_usec;
+	uint64_t snapshot_bytes;
+	uint64_t snapshot_fork_usec;
+	// Whether the last snapshot was a delta, the deltas written since the
+	// last full snapshot, their size and the full snapshot's size
+	int snapshot_last_delta;
+	uint64_t snapshot_chain;
+	uint64_t snapshot_chain_bytes;
+	uint64_t snapshot_base_bytes;
+	// Changes made to the queue, counted under scores_mutex, and the count
+	// and time when the last snapshot that succeeded was taken
+	uint64_t changes;
+	uint64_t saved_changes;
+	time_t last_save;
+	// Set by the loader: whether a snapshot is loading, the loads so far,
+	// the items in the last one and how long it took, how long the queue
+	// was locked to swap it in and the changes made meanwhile that were
+	// applied on top of it
+	int loading;
+	uint64_t loads;
+	uint64_t load_items;
+	uint64_t load_usec;
+	uint64_t load_swap_usec;
+	uint64_t load_captured;
+} app_stats;
+
+// Counters are kept per thread, each thread only writes its own cache line
+// and INFO sums them. Gauges such as items are kept as per thread deltas,
+// whose sum wraps back to the right value.
+struct thread_stats {
 	// Number of updates receieved
-	unsigned int updates;
+	uint64_t updates;
 	// Number of items created/inserted into `items`
-	unsigned int items;
+	uint64_t items;
 	// Number of created pools
-	unsigned int pools;
-} app_stats;
+	uint64_t pools;
+	// Requests processed, replies that were errors, and bytes read from
+	// and written to clients
+	uint64_t commands;
+	uint64_t error_replies;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	// Open client connections, connections accepted and connections
+	// refused by --max-clients
+	uint64_t connected_clients;
+	uint64_t connections;
+	uint64_t rejected_clients;
+	// Increments absorbed by the coalescing stage and merged updates it
+	// applied
+	uint64_t coalesce_received;
+	uint64_t coalesce_applied;
+	// UDP datagrams received and item updates applied from them
+	uint64_t udp_datagrams;
+	uint64_t udp_updates;
+	// Lines in datagrams that could not be parsed or applied
+	uint64_t udp_errors;
+	// Datagrams dropped by the server (truncated or sent during a snapshot
+	// load)
+	uint64_t udp_drops;
+	// Operations run by the engine thread and the batches they ran in
+	uint64_t engine_ops;
+	uint64_t engine_batches;
+	struct thread_stats *next;
+} __attribute__((aligned(STATS_CACHE_LINE)));
+
+extern __thread struct thread_stats *local_stats;
+
+struct thread_stats *stats_register();
+uint64_t stats_sum(size_t offset);
+
+static inline struct thread_stats *thread_stats()
+{
+	return local_stats != NULL ? local_stats : stats_register();
+}
+
+// Only the owning thread writes a counter, so no atomic read-modify-write
+// is needed.
+#define stats_add(field, n) do { \
+		struct thread_stats *_stats = thread_stats(); \
+		__atomic_store_n(&_stats->field, _stats->field + (n), __ATOMIC_RELAXED); \
+	} while (0)
+#define stats_get(field) stats_sum(offsetof(struct thread_stats, field))
 
 #endif
@@ -0,0 +1,415 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/*
+ * io_uring network backend, selected with --io-backend=uring.
+ *
+ * A multishot accept and one multishot receive per connection stay armed
+ * in the ring and receive into a ring of provided buffers, so reading
+ * costs no system call per connection. Completions are signalled through
+ * an eventfd watched by the libevent loop, which still drives timers, UDP
+ * and everything else. All submissions made while a batch of completions
+ * is handled go to the kernel in a single io_uring_enter().
+ *
+ * The ring is driven through the kernel interface directly rather than
+ * through liburing to avoid a new dependency.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_IO_URING_BACKEND
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "barbershop.h"
+#include "commands.h"
+#include "stats.h"
+#include "uring.h"
+
+// The operation is kept in the low bits of user_data, the rest is the
+// client it belongs to.
+#define URING_OP_ACCEPT		0
+#define URING_OP_RECV		1
+#define URING_OP_SEND		2
+#define URING_OP_CANCEL		3
+#define URING_OP_MASK		3
+
+static struct {
+	int fd;
+	int event_fd;
+	int listen_fd;
+	int reaping;
+	unsigned int sq_entries;
+	unsigned int sq_pending_tail;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	unsigned short buf_tail;
+	char *buffers;
+	struct event ev;
+} ring;
+
+static void uring_submit()
+{
+	unsigned int to_submit = ring.sq_pending_tail - *ring.sq_tail;
+	int rc;
+	if (to_submit == 0) {
+		return;
+	}
+	__atomic_store_n(ring.sq_tail, ring.sq_pending_tail, __ATOMIC_RELEASE);
+	do {
+		rc = syscall(__NR_io_uring_enter, ring.fd, to_submit, 0, 0, NULL, 0);
+	} while (rc < 0 && errno == EINTR);
+	if (rc < 0) {
+		warn("io_uring_enter failed");
+	}
+}
+
+static struct io_uring_sqe *uring_get_sqe()
+{
+	unsigned int head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if (ring.sq_pending_tail - head >= ring.sq_entries) {
+		uring_submit();
+	}
+	unsigned int index = ring.sq_pending_tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	ring.sq_pending_tail++;
+	return sqe;
+}
+
+static void uring_provide_buffer(unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring.buf_ring->bufs[ring.buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t)(ring.buffers + (size_t)bid * READ_CHUNK);
+	buf->len = READ_CHUNK;
+	buf->bid = bid;
+	ring.buf_tail++;
+	__atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_accept()
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring.listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK;
+	sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void uring_arm_recv(struct client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = (uintptr_t)client | URING_OP_RECV;
+	client->uring_pending++;
+}
+
+// Output is handed to the kernel from a separate buffer so that replies
+// added while a send is in flight can not move the bytes being sent.
+void uring_client_flush(struct client *client)
+{
+	if (client->sending) {
+		return;
+	}
+	if (EVBUFFER_LENGTH(client->in_flight) == 0) {
+		if (EVBUFFER_LENGTH(client->output) == 0) {
+			return;
+		}
+		evbuffer_add_buffer(client->in_flight, client->output);
+	}
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = client->fd;
+	sqe->addr = (uintptr_t)EVBUFFER_DATA(client->in_flight);
+	sqe->len = EVBUFFER_LENGTH(client->in_flight);
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = (uintptr_t)client | URING_OP_SEND;
+	client->sending = 1;
+	client->uring_pending++;
+	if (!ring.reaping) {
+		uring_submit();
+	}
+}
+
+// The client is released once the kernel no longer holds any operation
+// that refers to it; pending output is still sent.
+void uring_client_close(struct client *client)
+{
+	if (client->closing) {
+		return;
+	}
+	client->closing = 1;
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)client | URING_OP_RECV;
+	sqe->user_data = (uintptr_t)client | URING_OP_CANCEL;
+	client->uring_pending++;
+	if (!ring.reaping) {
+		uring_submit();
+	}
+}
+
+// Reading is paused by cancelling the multishot receive, whose final
+// completion then carries -ECANCELED.
+void uring_client_pause(struct client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uintptr_t)client | URING_OP_RECV;
+	sqe->user_data = (uintptr_t)client | URING_OP_CANCEL;
+	client->uring_pending++;
+	if (!ring.reaping) {
+		uring_submit();
+	}
+}
+
+void uring_client_resume(struct client *client)
+{
+	uring_arm_recv(client);
+	if (!ring.reaping) {
+		uring_submit();
+	}
+}
+
+static void uring_complete(struct io_uring_cqe *cqe)
+{
+	struct client *client = (struct client *)(uintptr_t)(cqe->user_data & ~(uint64_t)URING_OP_MASK);
+	int more = cqe->flags & IORING_CQE_F_MORE;
+	switch (cqe->user_data & URING_OP_MASK) {
+		case URING_OP_ACCEPT:
+			if (cqe->res >= 0 && max_clients > 0 && stats_get(connected_clients) >= max_clients) {
+				client_reject(cqe->res);
+			} else if (cqe->res >= 0) {
+				client = client_new(cqe->res);
+				uring_arm_recv(client);
+			} else if (ring.listen_fd >= 0) {
+				errno = -cqe->res;
+				warn("accept failed");
+			}
+			if (!more && ring.listen_fd >= 0) {
+				uring_arm_accept();
+			}
+			return;
+		case URING_OP_RECV:
+			if (!more) {
+				client->uring_pending--;
+			}
+			if (cqe->res > 0) {
+				unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				stats_add(bytes_in, cqe->res);
+				if (!client->closing) {
+					evbuffer_add(client->input, ring.buffers + (size_t)bid * READ_CHUNK, cqe->res);
+				}
+				uring_provide_buffer(bid);
+				if (!client->closing && !client->paused && !more) {
+					uring_arm_recv(client);
+				}
+				if (!client->closing && client->blocked && EVBUFFER_LENGTH(client->input) > MAX_QUERY_BUFFER) {
+					client_free(client);
+				} else if (!client->closing && !client->blocked && !client->paused) {
+					client_process(client);
+				}
+			} else if (!client->closing && !more && cqe->res != -ECANCELED) {
+				if (cqe->res == -ENOBUFS) {
+					if (!client->paused) {
+						uring_arm_recv(client);
+					}
+				} else {
+					client_free(client);
+				}
+			}
+			break;
+		case URING_OP_SEND:
+			client->uring_pending--;
+			client->sending = 0;
+			if (cqe->res > 0) {
+				stats_add(bytes_out, cqe->res);
+				evbuffer_drain(client->in_flight, cqe->res);
+				uring_client_flush(client);
+				client_check_resume(client);
+			} else if (!client->closing) {
+				client_free(client);
+			}
+			break;
+		case URING_OP_CANCEL:
+			client->uring_pending--;
+			break;
+	}
+	if (client->closing && client->uring_pending == 0) {
+		client_release(client);
+	}
+}
+
+static void on_uring_event(int fd, short ev, void *arg)
+{
+	uint64_t count;
+	unsigned int head, tail;
+	struct io_uring_cqe cqe;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		warn("eventfd read failed");
+	}
+	ring.reaping = 1;
+	while (1) {
+		head = *ring.cq_head;
+		tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			break;
+		}
+		for (; head != tail; head++) {
+			cqe = ring.cqes[head & *ring.cq_mask];
+			__atomic_store_n(ring.cq_head, head + 1, __ATOMIC_RELEASE);
+			uring_complete(&cqe);
+		}
+	}
+	ring.reaping = 0;
+	uring_submit();
+}
+
+static int uring_setup(struct io_uring_params *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+	p->cq_entries = URING_ENTRIES * 4;
+	int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, p);
+	if (fd < 0 && errno == EINVAL) {
+		// Kernels before 5.19 do not know COOP_TASKRUN.
+		p->flags = IORING_SETUP_CQSIZE;
+		fd = syscall(__NR_io_uring_setup, URING_ENTRIES, p);
+	}
+	return fd;
+}
+
+// On shutdown the listening socket is shut down, which fails the accept
+// armed on it. It is not armed again.
+void uring_stop_accept()
+{
+	ring.listen_fd = -1;
+}
+
+int uring_init(int listen_fd)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	char *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	int i;
+
+	ring.fd = uring_setup(&p);
+	if (ring.fd < 0) {
+		warn("io_uring_setup failed");
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		warnx("io_uring is too old, IORING_FEAT_SINGLE_MMAP is required");
+		close(ring.fd);
+		return -1;
+	}
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+	sq_ptr = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		warn("io_uring ring mmap failed");
+		close(ring.fd);
+		return -1;
+	}
+	cq_ptr = sq_ptr;
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		warn("io_uring sqe mmap failed");
+		close(ring.fd);
+		return -1;
+	}
+	ring.sq_entries = p.sq_entries;
+	ring.sq_head = (unsigned int *)(sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)(sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)(sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)(sq_ptr + p.sq_off.array);
+	ring.sq_pending_tail = *ring.sq_tail;
+	ring.cq_head = (unsigned int *)(cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)(cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)(cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+	if (posix_memalign((void **)&ring.buf_ring, sysconf(_SC_PAGESIZE), URING_BUFFERS * sizeof(struct io_uring_buf)) != 0 ||
+			(ring.buffers = malloc((size_t)URING_BUFFERS * READ_CHUNK)) == NULL) {
+		err(1, "malloc failed");
+	}
+	memset(ring.buf_ring, 0, URING_BUFFERS * sizeof(struct io_uring_buf));
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring.buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFFER_GROUP;
+	if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		warn("io_uring buffer ring registration failed");
+		close(ring.fd);
+		return -1;
+	}
+	for (i = 0; i < URING_BUFFERS; i++) {
+		uring_provide_buffer(i);
+	}
+
+	ring.event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if (ring.event_fd < 0 || syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_EVENTFD, &ring.event_fd, 1) < 0) {
+		warn("io_uring eventfd registration failed");
+		close(ring.fd);
+		return -1;
+	}
+	event_set(&ring.ev, ring.event_fd, EV_READ|EV_PERSIST, on_uring_event, NULL);
+	event_add(&ring.ev, NULL);
+
+	ring.listen_fd = listen_fd;
+	uring_arm_accept();
+	uring_submit();
+	return 0;
+}
+
+#endif
@@ -0,0 +1,192 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+// For fopencookie and sync_file_range.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency.h"
+#include "writer.h"
+
+struct writer {
+	int fd;
+	int throttle;
+	char *buffer;
+	off64_t position;
+	// Bytes written, started writing back and waited for so far.
+	uint64_t end;
+	uint64_t flushed;
+	uint64_t waited;
+	uint64_t started;
+};
+
+static struct writer_stats private_stats;
+static struct writer_stats *stats = &private_stats;
+
+// Snapshot children write their stats where the server reads them.
+void writer_init() {
+	void *shared = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared != MAP_FAILED) {
+		stats = shared;
+	}
+}
+
+// Sleeps until writing more keeps to --snapshot-rate on average.
+static void throttle(struct writer *writer) {
+	uint64_t due, now;
+	struct timespec delay;
+	if (!writer->throttle || snapshot_rate == 0) {
+		return;
+	}
+	due = writer->started + (uint64_t)((double)writer->end * 1e9 / snapshot_rate);
+	now = latency_now();
+	if (due <= now) {
+		return;
+	}
+	delay.tv_sec = (due - now) / 1000000000;
+	delay.tv_nsec = (due - now) % 1000000000;
+	while (nanosleep(&delay, &delay) < 0 && errno == EINTR) {
+	}
+	__atomic_add_fetch(&stats->throttle_usec, (latency_now() - now) / 1000, __ATOMIC_RELAXED);
+}
+
+static void sync_written(struct writer *writer) {
+#ifdef SYNC_FILE_RANGE_WRITE
+	uint64_t started;
+	if (writer->end - writer->flushed < WRITER_SYNC_BYTES) {
+		return;
+	}
+	sync_file_range(writer->fd, writer->flushed, writer->end - writer->flushed, SYNC_FILE_RANGE_WRITE);
+	if (writer->flushed > writer->waited) {
+		started = latency_now();
+		sync_file_range(writer->fd, writer->waited, writer->flushed - writer->waited,
+			SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		__atomic_add_fetch(&stats->sync_usec, (latency_now() - started) / 1000, __ATOMIC_RELAXED);
+	}
+	writer->waited = writer->flushed;
+	writer->flushed = writer->end;
+#endif
+}
+
+static ssize_t writer_write(void *cookie, const char *data, size_t size) {
+	struct writer *writer = cookie;
+	size_t done = 0;
+	ssize_t n;
+	throttle(writer);
+	while (done < size) {
+		n = pwrite(writer->fd, data + done, size - done, writer->position + done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return 0;
+		}
+		done += n;
+	}
+	writer->position += done;
+	if ((uint64_t)writer->position > writer->end) {
+		__atomic_add_fetch(&stats->bytes, writer->position - writer->end, __ATOMIC_RELAXED);
+		writer->end = writer->position;
+		sync_written(writer);
+	}
+	return done;
+}
+
+// Snapshots only seek back to the start to write their header.
+static int writer_seek(void *cookie, off64_t *offset, int whence) {
+	struct writer *writer = cookie;
+	if (whence == SEEK_CUR) {
+		*offset += writer->position;
+	} else if (whence == SEEK_END) {
+		*offset += writer->end;
+	}
+	if (*offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	writer->position = *offset;
+	return 0;
+}
+
+static int writer_close(void *cookie) {
+	struct writer *writer = cookie;
+	uint64_t started = latency_now();
+	int rval = fdatasync(writer->fd);
+	__atomic_add_fetch(&stats->sync_usec, (latency_now() - started) / 1000, __ATOMIC_RELAXED);
+	if (close(writer->fd) < 0) {
+		rval = -1;
+	}
+	__atomic_store_n(&stats->usec, (latency_now() - writer->started) / 1000, __ATOMIC_RELAXED);
+	free(writer->buffer);
+	free(writer);
+	return rval;
+}
+
+// Opens a snapshot file for writing, at no more than --snapshot-rate if
+// throttle is set. fclose() returns EOF if it could not be made durable.
+FILE *writer_open(const char *filename, int throttle) {
+	cookie_io_functions_t functions = { NULL, writer_write, writer_seek, writer_close };
+	struct writer *writer = calloc(1, sizeof(*writer));
+	FILE *out;
+	if (writer == NULL || posix_memalign((void **)&writer->buffer, 4096, WRITER_BUFFER) != 0) {
+		free(writer);
+		return NULL;
+	}
+	if ((writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		free(writer->buffer);
+		free(writer);
+		return NULL;
+	}
+	writer->throttle = throttle;
+	writer->started = latency_now();
+	memset(stats, 0, sizeof(*stats));
+	if ((out = fopencookie(writer, "w", functions)) == NULL) {
+		close(writer->fd);
+		free(writer->buffer);
+		free(writer);
+		return NULL;
+	}
+	setvbuf(out, writer->buffer, _IOFBF, WRITER_BUFFER);
+	return out;
+}
+
+int writer_info(char *out, size_t size) {
+	uint64_t usec = __atomic_load_n(&stats->usec, __ATOMIC_RELAXED);
+	uint64_t bytes = __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED);
+	int n = 0;
+	n += snprintf(out + n, size - n, "snapshot_write_bytes:%" PRIu64 "\r\n", bytes);
+	n += snprintf(out + n, size - n, "snapshot_write_rate:%" PRIu64 "\r\n", usec > 0 ? bytes * 1000000 / usec : 0);
+	n += snprintf(out + n, size - n, "snapshot_throttle_usec:%" PRIu64 "\r\n",
+		__atomic_load_n(&stats->throttle_usec, __ATOMIC_RELAXED));
+	n += snprintf(out + n, size - n, "snapshot_sync_usec:%" PRIu64 "\r\n",
+		__atomic_load_n(&stats->sync_usec, __ATOMIC_RELAXED));
+	return n;
+}
@@ -0,0 +1,55 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#ifndef __WRITER_H__
+#define __WRITER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Snapshots are written in WRITER_BUFFER chunks from a page aligned
+// buffer. Every WRITER_SYNC_BYTES the kernel is asked to start writing the
+// new chunks back and the writer waits for the ones before, so dirty pages
+// do not pile up into one long flush that stalls the journal's fsyncs.
+// The file is made durable when closed, before it is renamed into place.
+#define WRITER_BUFFER		(1024 * 1024)
+#define WRITER_SYNC_BYTES	(8 * 1024 * 1024)
+
+// The snapshot being written or the last one written. Kept in memory
+// shared with the snapshot child so the server sees its progress.
+struct writer_stats {
+	uint64_t bytes;
+	uint64_t usec;
+	uint64_t throttle_usec;
+	uint64_t sync_usec;
+};
+
+// Set by --snapshot-rate, in bytes per second, 0 for no limit.
+uint64_t snapshot_rate;
+
+void writer_init();
+FILE *writer_open(const char *filename, int throttle);
+int writer_info(char *out, size_t size);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <check.h>
+#include "../src/latency.h"
+#include "../src/pqueue.h"
+
+START_TEST (test_peek_published) {
+	initializePriorityQueue();
+	fail_unless(peekNext() == -1);
+	update(1, 1);
+	update(2, 5);
+	fail_unless(peekNext() == 2);
+	update(1, 10);
+	fail_unless(peekNext() == 1, "a promoted item becomes the top.");
+	update(3, 11);
+	fail_unless(peekNext() == 1, "ties keep their arrival order.");
+	fail_unless(getNext() == 1);
+	fail_unless(peekNext() == 3);
+	fail_unless(getNext() == 3);
+	fail_unless(getNext() == 2);
+	fail_unless(peekNext() == -1);
+} END_TEST
+
+START_TEST (test_get_score) {
+	initializePriorityQueue();
+	fail_unless(getScore(5) == -1);
+	update(5, 3);
+	update(4, 1);
+	update(6, 2);
+	update(5, 4);
+	fail_unless(getScore(5) == 7);
+	fail_unless(getScore(4) == 1);
+	fail_unless(getScore(6) == 2);
+	emptyPriorityQueue();
+	fail_unless(getScore(5) == -1);
+} END_TEST
+
+START_TEST (test_queue_shape) {
+	uint64_t sizes[POOL_SIZE_BUCKETS];
+	uint64_t waits;
+	int i;
+	initializePriorityQueue();
+	fail_unless(getTopAge() == -1);
+	for (i = 1; i <= 5; i++) {
+		update(i, 10);
+	}
+	update(6, 100);
+	update(7, 1);
+	getPoolSizes(sizes);
+	fail_unless(sizes[0] == 2, "pools of 100 and 1 hold one item.");
+	fail_unless(sizes[2] == 1, "the pool of 10 holds 4 to 7 items.");
+	fail_unless(getScorePercentile(50.0) == 10);
+	fail_unless(getScorePercentile(100.0) == 100);
+	fail_unless(getTopAge() >= 0);
+	update(7, 9);
+	getPoolSizes(sizes);
+	fail_unless(sizes[0] == 1 && sizes[2] == 1, "a promoted item leaves its pool.");
+	waits = getWaitTimes()->count;
+	fail_unless(getNext() == 6);
+	fail_unless(getWaitTimes()->count == waits + 1);
+	emptyPriorityQueue();
+	fail_unless(getWaitTimes()->count == waits + 1, "emptying the queue is not a wait.");
+	getPoolSizes(sizes);
+	for (i = 0; i < POOL_SIZE_BUCKETS; i++) {
+		fail_unless(sizes[i] == 0);
+	}
+	fail_unless(getScorePercentile(50.0) == 0);
+	update(1, 5);
+	update(2, 7);
+	fail_unless(getScorePercentile(50.0) == 5);
+	fail_unless(getScorePercentile(90.0) == 7);
+	fail_unless(getScorePercentile(99.0) == 7, "the p99 of two items is the larger score.");
+} END_TEST
+
+struct collected {
+	int pairs[64];
+	size_t count;
+};
+
+static void collect(int itemId, int score, void *arg) {
+	struct collected *c = arg;
+	c->pairs[2 * c->count] = itemId;
+	c->pairs[2 * c->count + 1] = score;
+	c->count++;
+}
+
+START_TEST (test_bulk_load) {
+	struct collected before = { .count = 0 }, after = { .count = 0 };
+	int i;
+	int unordered[] = { 1, 5, 2, 9 };
+	int repeated[] = { 1, 9, 1, 5 };
+	initializePriorityQueue();
+	for (i = 1; i <= 20; i++) {
+		update(i, i % 4 + 1);
+	}
+	update(3, 10);
+	fail_unless(iterateByPriority(collect, &before) == 0);
+	fail_unless(before.count == 20);
+	fail_unless(before.pairs[0] == 3 && before.pairs[1] == 14, "the top item comes first.");
+	emptyPriorityQueue();
+	fail_unless(bulkLoad(before.pairs, before.count) == 0);
+	fail_unless(peekNext() == 3);
+	fail_unless(getScore(20) == 1);
+	iterateByPriority(collect, &after);
+	fail_unless(memcmp(before.pairs, after.pairs, sizeof(before.pairs)) == 0, "pools keep their order.");
+	fail_unless(bulkLoad(before.pairs, before.count) == -1, "the queue must be empty.");
+	emptyPriorityQueue();
+	fail_unless(bulkLoad(unordered, 2) == -1);
+	fail_unless(bulkLoad(repeated, 2) == -1);
+	fail_unless(peekNext() == -1);
+} END_TEST
+
+START_TEST (test_remove_item) {
+	initializePriorityQueue();
+	update(1, 5);
+	update(2, 5);
+	update(3, 1);
+	fail_unless(removeItem(4) == 0, "missing items are left alone.");
+	fail_unless(removeItem(1) == 1);
+	fail_unless(getScore(1) == -1);
+	fail_unless(peekNext() == 2);
+	fail_unless(removeItem(2) == 1);
+	fail_unless(peekNext() == 3, "the emptied pool is gone.");
+	fail_unless(getNext() == 3);
+	fail_unless(getNext() == -1);
+} END_TEST
+
+START_TEST (test_swap_queue) {
+	struct collected before = { .count = 0 }, after = { .count = 0 };
+	struct queue_image image;
+	int updates[] = { 1, 5, 2, 3, 3, 5, 1, 2, 4, 6, 2, 4, 4, 1 };
+	int i;
+	initializePriorityQueue();
+	for (i = 0; i < 7; i++) {
+		update(updates[2 * i], updates[2 * i + 1]);
+	}
+	iterateByPriority(collect, &before);
+	emptyPriorityQueue();
+	update(9, 100);
+	fail_unless(buildQueue(updates, 7, 1, 1, &image) == 0);
+	fail_unless(peekNext() == 9, "the queue being served is untouched.");
+	swapQueue(&image);
+	fail_unless(getScore(9) == -1);
+	iterateByPriority(collect, &after);
+	fail_unless(after.count == before.count);
+	fail_unless(memcmp(before.pairs, after.pairs, sizeof(before.pairs)) == 0, "the queue is as the updates left it.");
+	releaseQueue(&image);
+	reclaimQueue(&image);
+	update(9, 100);
+	fail_unless(peekNext() == 9);
+	fail_unless(getScore(1) == 7);
+} END_TEST
+
+struct matched {
+	const int *pairs;
+	size_t count;
+	int mismatches;
+};
+
+static void match(int itemId, int score, void *arg) {
+	struct matched *m = arg;
+	if (m->pairs[2 * m->count] != itemId || m->pairs[2 * m->count + 1] != score) {
+		m->mismatches++;
+	}
+	m->count++;
+}
+
+// Large enough to be split into ranges, with pools spanning them.
+START_TEST (test_parallel_build) {
+	struct queue_image image;
+	struct matched m = { .count = 0, .mismatches = 0 };
+	size_t i, count = 400000;
+	int *pairs = malloc(2 * count * sizeof(int)), *updates = malloc(4 * count * sizeof(int));
+	for (i = 0; i < count; i++) {
+		pairs[2 * i] = (int)((i * 2654435761u) % 1000000007u);
+		pairs[2 * i + 1] = i < count / 2 ? 1000 - (int)(i / 1000) : 3 - (int)(3 * i / count);
+	}
+	initializePriorityQueue();
+	fail_unless(buildQueue(pairs, count, 0, 4, &image) == 0);
+	swapQueue(&image);
+	releaseQueue(&image);
+	reclaimQueue(&image);
+	m.pairs = pairs;
+	fail_unless(iterateByPriority(match, &m) == 0);
+	fail_unless(m.count == count && m.mismatches == 0, "ranges are joined in order.");
+	fail_unless(getScore(pairs[2 * (count - 1)]) == 1);
+	// Every item updated twice, the second time in reverse order.
+	for (i = 0; i < count; i++) {
+		updates[2 * i] = pairs[2 * i];
+		updates[2 * i + 1] = 1;
+		updates[2 * (2 * count - 1 - i)] = pairs[2 * i];
+		updates[2 * (2 * count - 1 - i) + 1] = i % 2 + 1;
+	}
+	fail_unless(buildQueue(updates, 2 * count, 1, 4, &image) == 0);
+	swapQueue(&image);
+	releaseQueue(&image);
+	reclaimQueue(&image);
+	fail_unless(getScore(pairs[0]) == 2 && getScore(pairs[2]) == 3);
+	fail_unless(peekNext() == pairs[2 * (count - 1)], "the last one updated comes first.");
+	emptyPriorityQueue();
+	free(pairs);
+	free(updates);
+} END_TEST
+
+static volatile int writer_done;
+
+// Churns the item tree around item 1, which is never removed so its score
+// only ever grows.
+static void *churn(void *arg) {
+	int i, j;
+	for (i = 0; i < 20000; i++) {
+		update(1, 1);
+		for (j = 2; j < 10; j++) {
+			update((i * 7 + j) % 1000 + 2, j);
+		}
+		if (i % 3 == 0 && peekNext() != 1) {
+			getNext();
+		}
+	}
+	writer_done = 1;
+	return NULL;
+}
+
+START_TEST (test_concurrent_reads) {
+	pthread_t writer;
+	int score, last = 0;
+	initializePriorityQueue();
+	update(1, 1);
+	writer_done = 0;
+	pthread_create(&writer, NULL, churn, NULL);
+	while (!writer_done) {
+		score = getScore(1);
+		fail_unless(score >= last, "reads are never torn.");
+		last = score;
+	}
+	pthread_join(writer, NULL);
+} END_TEST
+
+START_TEST (test_latency_percentile) {
+	static struct latency_histogram histogram;
+	uint64_t i;
+	latency_reset(&histogram);
+	fail_unless(latency_percentile(&histogram, 99.0) == 0);
+	latency_record(&histogram, 10);
+	latency_record(&histogram, 1000);
+	fail_unless(latency_percentile(&histogram, 50.0) == 10);
+	fail_unless(latency_percentile(&histogram, 99.0) == 1000, "the p99 of two values is the larger one.");
+	latency_reset(&histogram);
+	for (i = 1; i <= 10; i++) {
+		latency_record(&histogram, i);
+	}
+	fail_unless(latency_percentile(&histogram, 0.0) == 1);
+	fail_unless(latency_percentile(&histogram, 50.0) == 5);
+	fail_unless(latency_percentile(&histogram, 99.0) == 10);
+	fail_unless(latency_percentile(&histogram, 100.0) == 10);
+	latency_reset(&histogram);
+	for (i = 0; i < 41000; i++) {
+		latency_record(&histogram, i < 40959 ? 1 : 2);
+	}
+	fail_unless(latency_percentile(&histogram, 99.9) == 1, "exact ranks are not rounded up.");
+} END_TEST
+
+Suite * pqueue_suite(void) {
+	Suite *s = suite_create("PriorityQueue");
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, test_peek_published);
+	tcase_add_test(tc_core, test_get_score);
+	tcase_add_test(tc_core, test_queue_shape);
+	tcase_add_test(tc_core, test_bulk_load);
+	tcase_add_test(tc_core, test_remove_item);
+	tcase_add_test(tc_core, test_swap_queue);
+	tcase_add_test(tc_core, test_parallel_build);
+	tcase_add_test(tc_core, test_concurrent_reads);
+	tcase_add_test(tc_core, test_latency_percentile);
+	suite_add_tcase(s, tc_core);
+	return s;
+}
+
+int main (void) {
+	int number_failed;
+	Suite *s = pqueue_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
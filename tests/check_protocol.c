@@ -0,0 +1,130 @@
+/*
+Copyright (c) 2010 Nick Gerakines <nick at gerakines dot net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <check.h>
+#include "../src/protocol.h"
+
+START_TEST (test_parse_integer) {
+	token_t t;
+	int value;
+	t.value = "61231"; t.length = 5;
+	fail_unless(parse_integer(&t, &value) == 0 && value == 61231);
+	t.value = "-1"; t.length = 2;
+	fail_unless(parse_integer(&t, &value) == 0 && value == -1);
+	t.value = "2147483647"; t.length = 10;
+	fail_unless(parse_integer(&t, &value) == 0 && value == 2147483647);
+	t.value = "-2147483648"; t.length = 11;
+	fail_unless(parse_integer(&t, &value) == 0 && value == -2147483647 - 1);
+	t.value = "2147483648"; t.length = 10;
+	fail_unless(parse_integer(&t, &value) == -1, "overflow is rejected.");
+	t.value = "12abc"; t.length = 5;
+	fail_unless(parse_integer(&t, &value) == -1, "trailing garbage is rejected.");
+	t.value = "-"; t.length = 1;
+	fail_unless(parse_integer(&t, &value) == -1);
+	t.value = NULL; t.length = 0;
+	fail_unless(parse_integer(&t, &value) == -1);
+} END_TEST
+
+START_TEST (test_lookup_command) {
+	fail_unless(lookup_command("UPDATE", 6) == COMMAND_UPDATE);
+	fail_unless(lookup_command("update", 6) == COMMAND_UPDATE);
+	fail_unless(lookup_command("PEEK", 4) == COMMAND_PEEK);
+	fail_unless(lookup_command("ping", 4) == COMMAND_PING);
+	fail_unless(lookup_command("BNEXT", 5) == COMMAND_BNEXT);
+	fail_unless(lookup_command("stats", 5) == COMMAND_STATS);
+	fail_unless(lookup_command("SLOWLOG", 7) == COMMAND_SLOWLOG);
+	fail_unless(lookup_command("MUPDATE", 7) == COMMAND_MUPDATE);
+	fail_unless(lookup_command("NEXTX", 5) == COMMAND_UNKNOWN);
+	fail_unless(lookup_command("N@XT", 4) == COMMAND_UNKNOWN);
+	fail_unless(lookup_command(NULL, 0) == COMMAND_UNKNOWN);
+} END_TEST
+
+START_TEST (test_token_is) {
+	token_t t;
+	t.value = "latency"; t.length = 7;
+	fail_unless(token_is(&t, "LATENCY"));
+	t.length = 6;
+	fail_unless(!token_is(&t, "LATENCY"), "a prefix does not match.");
+	t.value = NULL; t.length = 0;
+	fail_unless(!token_is(&t, "LATENCY"));
+} END_TEST
+
+START_TEST (test_parse_inline) {
+	char buf[] = "UPDATE 61231 5\r\nNEXT\r\nPEE";
+	token_t tokens[MAX_TOKENS];
+	size_t ntokens;
+	int protocol;
+	int consumed = parse_request(buf, strlen(buf), &protocol, tokens, &ntokens);
+	fail_unless(consumed == 16);
+	fail_unless(protocol == PROTOCOL_INLINE);
+	fail_unless(ntokens == 4);
+	fail_unless(strcmp(tokens[KEY_TOKEN].value, "61231") == 0);
+	fail_unless(tokens[VALUE_TOKEN].length == 1);
+	fail_unless(tokens[3].value == NULL);
+	consumed = parse_request(buf + 16, 6, &protocol, tokens, &ntokens);
+	fail_unless(consumed == 6 && ntokens == 2);
+	fail_unless(parse_request(buf + 22, 3, &protocol, tokens, &ntokens) == 0, "partial lines wait for more input.");
+} END_TEST
+
+START_TEST (test_parse_multibulk) {
+	char buf[] = "*3\r\n$6\r\nUPDATE\r\n$5\r\n61231\r\n$1\r\n5\r\n";
+	token_t tokens[MAX_TOKENS];
+	size_t ntokens;
+	int protocol;
+	size_t length = strlen(buf);
+	fail_unless(parse_request(buf, length - 3, &protocol, tokens, &ntokens) == 0);
+	fail_unless(parse_request(buf, length, &protocol, tokens, &ntokens) == (int)length);
+	fail_unless(protocol == PROTOCOL_RESP);
+	fail_unless(ntokens == 4);
+	fail_unless(strcmp(tokens[COMMAND_TOKEN].value, "UPDATE") == 0);
+	fail_unless(strcmp(tokens[VALUE_TOKEN].value, "5") == 0);
+	char bad[] = "*1\r\n$4\r\nNEXTXX\r\n";
+	fail_unless(parse_request(bad, strlen(bad), &protocol, tokens, &ntokens) == -1);
+	char huge[] = "*99\r\n";
+	fail_unless(parse_request(huge, strlen(huge), &protocol, tokens, &ntokens) == -1);
+} END_TEST
+
+Suite * protocol_suite(void) {
+	Suite *s = suite_create("Protocol");
+	TCase *tc_core = tcase_create("Core");
+	tcase_add_test(tc_core, test_parse_integer);
+	tcase_add_test(tc_core, test_lookup_command);
+	tcase_add_test(tc_core, test_token_is);
+	tcase_add_test(tc_core, test_parse_inline);
+	tcase_add_test(tc_core, test_parse_multibulk);
+	suite_add_tcase(s, tc_core);
+	return s;
+}
+
+int main (void) {
+	int number_failed;
+	Suite *s = protocol_suite();
+	SRunner *sr = srunner_create(s);
+	srunner_run_all(sr, CK_VERBOSE);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}